@@ -0,0 +1,222 @@
+// ------------------------------------------------------------------------
+// ------------------------------ Analyze ---------------------------------
+//
+// Searches a position with the engine of search.c and prints every completed
+// iteration, for position analysis and for checking the search from scripts.
+//
+//   analyze [options] ["fen"]
+//
+//   -depth <n>     stop after this iteration
+//   -nodes <n>     stop after about this many nodes
+//   -time <ms>     stop after about this long
+//   -hash <mb>     transposition table size, default 16, 0 searches without one
+//   -hugepages     ask for the table in huge pages
+//   -threads <n>   Lazy SMP search threads, 0 uses every core
+//   -eval <file>   piece values and piece-square tables to use, see eval_load
+//   -evalsave <file> write the ones in use to file and exit
+//   -scaling       search to the depth with 1, 2, 4... up to the threads and
+//                  compare time to depth and nodes/second, the table is
+//                  cleared before every run
+//
+// Without a limit the search stops at depth 8. Every iteration prints:
+//   depth <d> score cp <x> | mate <n> nodes <n> nps <n> time <ms> hashfull <permille> pv <moves>
+// and the table hit rate is printed at the end.
+
+#include <stdio.h>
+#include <string.h>
+#include <os.h>
+#include <game.h>
+#include <search.h>
+#include <eval.h>
+
+#if !defined(_WIN32)
+#include <unistd.h>
+#endif
+
+#define STARTPOS "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1"
+#define DEFAULT_DEPTH 8
+#define DEFAULT_HASH_MB 16
+
+static void
+move_to_string(Chess_Packed_Move move, char* buffer)
+{
+    s32 from = CHESS_MOVE_FROM(move), to = CHESS_MOVE_TO(move);
+    buffer[0] = 'a' + from % 8;
+    buffer[1] = '1' + from / 8;
+    buffer[2] = 'a' + to % 8;
+    buffer[3] = '1' + to / 8;
+    buffer[4] = (CHESS_MOVE_FLAG(move) == CHESS_MOVE_PROMOTION) ? "nbrq"[CHESS_MOVE_PROMOTION(move)] : 0;
+    buffer[5] = 0;
+}
+
+static s32
+cpu_count()
+{
+#if defined(_WIN32)
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (s32)info.dwNumberOfProcessors;
+#else
+    s32 count = (s32)sysconf(_SC_NPROCESSORS_ONLN);
+    return (count > 0) ? count : 1;
+#endif
+}
+
+static void
+print_score(s32 score)
+{
+    if (SEARCH_IS_MATE(score)) {
+        // In moves, negative when the side to move gets mated
+        s32 plies = SEARCH_MATE - abs(score);
+        printf("mate %d", (score > 0) ? (plies + 1) / 2 : -(plies / 2));
+    } else {
+        printf("cp %d", score);
+    }
+}
+
+// user is the transposition table or null
+static void
+print_iteration(const Search_Result* result, void* user)
+{
+    TT_Table* tt = (TT_Table*)user;
+    r64 seconds = result->elapsed_ms / 1000.0;
+    u64 nps = (seconds > 0) ? (u64)(result->nodes / seconds) : 0;
+    printf("depth %d score ", result->depth);
+    print_score(result->score);
+    printf(" nodes %llu nps %llu time %.0f", result->nodes, nps, result->elapsed_ms);
+    if (tt)
+        printf(" hashfull %d", tt_hashfull(tt));
+    printf(" pv");
+    for (s32 i = 0; i < result->pv_length; ++i) {
+        char name[8];
+        move_to_string(result->pv[i], name);
+        printf(" %s", name);
+    }
+    printf("\n");
+    fflush(stdout);
+}
+
+// Time to depth of the same search with more and more threads
+static void
+run_scaling(Game* game, TT_Table* tt, Search_Limits limits, s32 max_threads)
+{
+    r64 base_ms = 0;
+    for (s32 threads = 1;; threads *= 2) {
+        if (threads > max_threads)
+            threads = max_threads;
+        limits.threads = threads;
+        if (tt)
+            tt_clear(tt);
+
+        Search_Result result;
+        search_run(game, tt, &limits, 0, 0, &result);
+        if (threads == 1)
+            base_ms = result.elapsed_ms;
+
+        r64 seconds = result.elapsed_ms / 1000.0;
+        u64 nps = (seconds > 0) ? (u64)(result.nodes / seconds) : 0;
+        r64 speedup = (result.elapsed_ms > 0) ? base_ms / result.elapsed_ms : 0;
+        char name[8];
+        move_to_string(result.best_move, name);
+        printf("threads %3d depth %d time %8.0f ms nodes %12llu nps %10llu speedup %.2f bestmove %s\n",
+            threads, result.depth, result.elapsed_ms, result.nodes, nps, speedup, name);
+        fflush(stdout);
+
+        if (threads == max_threads)
+            break;
+    }
+}
+
+int
+main(int argc, char** argv)
+{
+    Search_Limits limits = {0};
+    char* fen = STARTPOS;
+    s32 hash_mb = DEFAULT_HASH_MB;
+    bool huge_pages = false;
+    bool scaling = false;
+    const char* eval_file = 0;
+    const char* eval_save_file = 0;
+
+    for (s32 i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-depth") == 0 && i + 1 < argc) {
+            limits.max_depth = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-nodes") == 0 && i + 1 < argc) {
+            limits.max_nodes = strtoull(argv[++i], 0, 10);
+        } else if (strcmp(argv[i], "-time") == 0 && i + 1 < argc) {
+            limits.max_time_ms = atof(argv[++i]);
+        } else if (strcmp(argv[i], "-hash") == 0 && i + 1 < argc) {
+            hash_mb = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-hugepages") == 0) {
+            huge_pages = true;
+        } else if (strcmp(argv[i], "-threads") == 0 && i + 1 < argc) {
+            limits.threads = atoi(argv[++i]);
+            if (limits.threads <= 0)
+                limits.threads = cpu_count();
+        } else if (strcmp(argv[i], "-eval") == 0 && i + 1 < argc) {
+            eval_file = argv[++i];
+        } else if (strcmp(argv[i], "-evalsave") == 0 && i + 1 < argc) {
+            eval_save_file = argv[++i];
+        } else if (strcmp(argv[i], "-scaling") == 0) {
+            scaling = true;
+        } else if (argv[i][0] == '-') {
+            printf("usage: analyze [-depth <n>] [-nodes <n>] [-time <ms>] [-hash <mb>] [-hugepages]\n");
+            printf("               [-threads <n>] [-eval <file>] [-evalsave <file>] [-scaling] [\"fen\"]\n");
+            return 1;
+        } else {
+            fen = argv[i];
+        }
+    }
+    if (limits.max_depth <= 0 && limits.max_nodes == 0 && limits.max_time_ms <= 0)
+        limits.max_depth = DEFAULT_DEPTH;
+
+    eval_init();
+    if (eval_file && !eval_load(eval_file)) {
+        printf("can't load the evaluation from %s\n", eval_file);
+        return 1;
+    }
+    if (eval_save_file)
+        return (eval_save(eval_save_file)) ? 0 : 1;
+
+    Game game = {0};
+    game_new(&game);
+    if (parse_fen(fen, &game) != 0) {
+        printf("invalid fen: %s\n", fen);
+        return 1;
+    }
+
+    TT_Table tt = {0};
+    if (hash_mb > 0 && !tt_new(&tt, hash_mb, huge_pages)) {
+        printf("can't allocate a %d MB table\n", hash_mb);
+        return 1;
+    }
+    TT_Table* tt_ptr = (hash_mb > 0) ? &tt : 0;
+
+    if (scaling) {
+        if (limits.max_depth <= 0)
+            limits.max_depth = DEFAULT_DEPTH;
+        run_scaling(&game, tt_ptr, limits, (limits.threads > 1) ? limits.threads : 1);
+        if (tt_ptr)
+            tt_free(&tt);
+        return 0;
+    }
+
+    Search_Result result;
+    search_run(&game, tt_ptr, &limits, print_iteration, tt_ptr, &result);
+
+    if (tt_ptr) {
+        r64 rate = (result.tt_stats.probes > 0) ? 100.0 * result.tt_stats.hits / result.tt_stats.probes : 0;
+        printf("hash %llu MB%s, probes %llu, hits %.1f%%, stores %llu\n", tt.size / (1024 * 1024),
+            (tt.huge_pages) ? " in huge pages" : "", result.tt_stats.probes, rate, result.tt_stats.stores);
+        tt_free(&tt);
+    }
+
+    if (result.best_move == CHESS_MOVE_NONE) {
+        printf("bestmove none (%s)\n", (result.score < 0) ? "checkmate" : "stalemate");
+    } else {
+        char name[8];
+        move_to_string(result.best_move, name);
+        printf("bestmove %s\n", name);
+    }
+    return 0;
+}
@@ -0,0 +1,9 @@
+@echo off
+
+if not exist bin\ (
+    mkdir bin
+)
+
+pushd bin
+cl /nologo /O2 /I../.. /I../../include ../analyze.c ../../game.c ../../eval.c ../../fen.c ../../bitboard.c ../../movepick.c ../../see.c ../../search.c ../../tt.c ../../os.c ../../os_file.c /Fe:analyze.exe /link user32.lib
+popd
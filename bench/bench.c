@@ -0,0 +1,421 @@
+// ------------------------------------------------------------------------
+// ------------------------------- Bench ----------------------------------
+//
+// Timed, repeatable microbenchmarks of the rules code, the parsers and the
+// hash table, meant to be compared across releases.
+//
+//   bench [-json] [-time <ms>] [-repeat <n>] [filter]
+//
+//   -json          print the results as JSON instead of a table
+//   -time <ms>     minimum duration of one measured run, default 100
+//   -repeat <n>    measured runs per case, the median is reported, default 5
+//   filter         only run the cases whose name contains it
+//
+// Allocation counts need the build to wrap malloc, calloc and realloc, which
+// the Makefile does with the linker. Other builds report them as -1.
+
+#include <stdio.h>
+#include <string.h>
+#include <os.h>
+#include <game.h>
+#include <interface.h>
+#include <light_array.h>
+
+#define HOHT_IMPLEMENTATION
+#include <hoht.h>
+
+#define BENCH_MAX_RUNS 64
+#define BENCH_GAME_PLIES 120
+#define BENCH_HASH_KEYS 1024
+
+#define KIWIPETE "r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1"
+
+// ------------------------------------------------------------------------
+// Allocation counting
+
+static s64 bench_allocations;
+static s64 bench_allocated_bytes;
+
+#if defined(BENCH_COUNT_ALLOCATIONS)
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t count, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+
+void*
+__wrap_malloc(size_t size)
+{
+    bench_allocations++;
+    bench_allocated_bytes += size;
+    return __real_malloc(size);
+}
+
+void*
+__wrap_calloc(size_t count, size_t size)
+{
+    bench_allocations++;
+    bench_allocated_bytes += count * size;
+    return __real_calloc(count, size);
+}
+
+void*
+__wrap_realloc(void* ptr, size_t size)
+{
+    bench_allocations++;
+    bench_allocated_bytes += size;
+    return __real_realloc(ptr, size);
+}
+#endif
+
+// ------------------------------------------------------------------------
+// Fixtures, built once before any case is timed
+
+typedef struct {
+    Game kiwipete;
+    Chess_Move kiwipete_moves[MAX_MOVES];
+    s32 kiwipete_move_count;
+
+    Chess_Move game_moves[BENCH_GAME_PLIES];
+    s32 game_length;
+    Game start_game;            // starting position the game moves are replayed on
+
+    Game long_game;             // 1000 plies of history, the clock near the 50 move limit
+
+    Hoht_Table table;           // holds every key, for the lookups
+    char keys[BENCH_HASH_KEYS][16];
+} Bench_Fixtures;
+
+static Bench_Fixtures fixtures;
+
+static const char* bench_fens[] = {
+    "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1",
+    KIWIPETE,
+    "8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1",
+    "r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/R2Q1RK1 w kq - 0 1",
+    "rnbq1k1r/pp1Pbppp/2p5/8/2B5/8/PPP1NnPP/RNBQK2R w KQ - 1 8",
+    "r4rk1/1pp1qppp/p1np1n2/2b1p1B1/2B1P1b1/P1NP1N2/1PP1QPPP/R4RK1 w - - 0 10",
+};
+
+static const char* bench_config =
+    "server\t  = localhost\n"
+    "port      = 9999\n"
+    "black_background = { 0.4627, 0.5882, 0.3372, 1.0 }\n"
+    "white_background = { 0.9333, 0.9333, 0.8235, 1.0 }\n";
+
+static u64
+bench_random(u64* state)
+{
+    // xorshift64*
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1DULL;
+}
+
+static void
+fixtures_init()
+{
+    Game* kiwipete = &fixtures.kiwipete;
+    game_new(kiwipete);
+    parse_fen(KIWIPETE, kiwipete);
+    Gen_Moves moves;
+    generate_possible_moves(kiwipete, &moves);
+    for (s32 i = 0; i < moves.count; ++i)
+        fixtures.kiwipete_moves[i] = chess_move_unpack(kiwipete, moves.move[i]);
+    fixtures.kiwipete_move_count = moves.count;
+
+    // A game of random legal moves from a fixed seed, the same every run
+    Game game = {0};
+    game_new(&game);
+    u64 seed = 0x9E3779B97F4A7C15ULL;
+    while (fixtures.game_length < BENCH_GAME_PLIES && game.winner == PLAYER_NONE) {
+        generate_possible_moves(&game, &moves);
+        if (moves.count == 0)
+            break;
+        Chess_Move move = chess_move_unpack(&game, moves.move[bench_random(&seed) % moves.count]);
+        fixtures.game_moves[fixtures.game_length++] = move;
+        game_move_apply(&game, move, false, 0);
+    }
+
+    // The history arrays of the replay grow once here, so the timed runs only
+    // rewind them and never allocate
+    Game* start_game = &fixtures.start_game;
+    game_new(start_game);
+    for (s32 i = 0; i < fixtures.game_length; ++i)
+        game_move_apply(start_game, fixtures.game_moves[i], false, 0);
+    Game_History* start_history = (Game_History*)start_game->history;
+    while (array_length(start_history->entries) > 0)
+        game_undo(start_game);
+
+    // Repetition scans stop at the last capture or pawn move, so the clock is
+    // set just under the limit to make every scan the longest possible
+    Game* long_game = &fixtures.long_game;
+    game_new(long_game);
+    Game_History* history = (Game_History*)long_game->history;
+    for (s32 i = 0; i < 1000; ++i)
+        array_push(history->keys, bench_random(&seed));
+    long_game->pos.move_draw_count = 99;
+
+    hoht_new(&fixtures.table, BENCH_HASH_KEYS * 4, sizeof(s32), 0.5f, malloc, free);
+    for (s32 i = 0; i < BENCH_HASH_KEYS; ++i) {
+        sprintf(fixtures.keys[i], "key%d", i);
+        hoht_push(&fixtures.table, fixtures.keys[i], &i);
+    }
+}
+
+// ------------------------------------------------------------------------
+// Cases, each runs the operation iterations times over and returns the
+// number of operations done
+
+// Every iteration replays the game from a copy of the start, sharing its
+// history, which is rewound to the first position in between
+static s64
+bench_game_move_real(s64 iterations)
+{
+    s64 ops = 0;
+    Game game;
+    Game_History* history = (Game_History*)fixtures.start_game.history;
+    for (s64 it = 0; it < iterations; ++it) {
+        game = fixtures.start_game;
+        array_length(history->entries) = 0;
+        array_length(history->keys) = 1;
+        for (s32 i = 0; i < fixtures.game_length; ++i)
+            game_move_apply(&game, fixtures.game_moves[i], false, 0);
+        ops += fixtures.game_length;
+    }
+    return ops;
+}
+
+static s64
+bench_game_move_simulate(s64 iterations)
+{
+    s64 ops = 0;
+    for (s64 it = 0; it < iterations; ++it) {
+        for (s32 i = 0; i < fixtures.kiwipete_move_count; ++i)
+            game_move_apply(&fixtures.kiwipete, fixtures.kiwipete_moves[i], true, 0);
+        ops += fixtures.kiwipete_move_count;
+    }
+    return ops;
+}
+
+static s64
+bench_moves_from_square(s64 iterations)
+{
+    Gen_Moves moves;
+    s32 total = 0;
+    for (s64 it = 0; it < iterations; ++it) {
+        for (s32 square = 0; square < 64; ++square)
+            total += generate_all_valid_moves_from_square(&fixtures.kiwipete, &moves, square % 8, square / 8);
+    }
+    return (total >= 0) ? iterations * 64 : 0;
+}
+
+static s64
+bench_check_repetition(s64 iterations)
+{
+    s32 found = 0;
+    for (s64 it = 0; it < iterations; ++it)
+        found += check_repetition(&fixtures.long_game);
+    return (found >= 0) ? iterations : 0;
+}
+
+static s64
+bench_parse_fen(s64 iterations)
+{
+    Game game = {0};
+    s32 count = sizeof(bench_fens) / sizeof(*bench_fens);
+    for (s64 it = 0; it < iterations; ++it)
+        parse_fen((s8*)bench_fens[it % count], &game);
+    return iterations;
+}
+
+static s64
+bench_parse_config(s64 iterations)
+{
+    Chess_Config config = {0};
+    for (s64 it = 0; it < iterations; ++it)
+        parse_config(bench_config, &config);
+    return iterations;
+}
+
+static s64
+bench_hoht_push(s64 iterations)
+{
+    for (s64 it = 0; it < iterations; ++it) {
+        Hoht_Table table = {0};
+        hoht_new(&table, BENCH_HASH_KEYS * 4, sizeof(s32), 0.5f, malloc, free);
+        for (s32 i = 0; i < BENCH_HASH_KEYS; ++i)
+            hoht_push(&table, fixtures.keys[i], &i);
+        hoht_free(&table);
+    }
+    return iterations * BENCH_HASH_KEYS;
+}
+
+static s64
+bench_hoht_get(s64 iterations)
+{
+    s32 sum = 0;
+    for (s64 it = 0; it < iterations; ++it) {
+        for (s32 i = 0; i < BENCH_HASH_KEYS; ++i) {
+            s32 value = 0;
+            hoht_get(&fixtures.table, fixtures.keys[i], &value);
+            sum += value;
+        }
+    }
+    return (sum >= 0) ? iterations * BENCH_HASH_KEYS : 0;
+}
+
+// A delete is timed with the push that puts the key back
+static s64
+bench_hoht_delete(s64 iterations)
+{
+    for (s64 it = 0; it < iterations; ++it) {
+        for (s32 i = 0; i < BENCH_HASH_KEYS; ++i) {
+            hoht_delete(&fixtures.table, fixtures.keys[i]);
+            hoht_push(&fixtures.table, fixtures.keys[i], &i);
+        }
+    }
+    return iterations * BENCH_HASH_KEYS;
+}
+
+typedef struct {
+    const char* name;
+    s64 (*run)(s64 iterations);
+} Bench_Case;
+
+static Bench_Case bench_cases[] = {
+    { "game_move/real",                       bench_game_move_real },
+    { "game_move/simulate",                   bench_game_move_simulate },
+    { "generate_all_valid_moves_from_square", bench_moves_from_square },
+    { "check_repetition/long_game",           bench_check_repetition },
+    { "parse_fen",                            bench_parse_fen },
+    { "parse_config",                         bench_parse_config },
+    { "hoht/push",                            bench_hoht_push },
+    { "hoht/get",                             bench_hoht_get },
+    { "hoht/delete_push",                     bench_hoht_delete },
+};
+
+// ------------------------------------------------------------------------
+// Runner
+
+typedef struct {
+    const char* name;
+    s64 ops;                    // operations in one measured run
+    r64 ns_per_op;              // median of the runs
+    r64 min_ns_per_op;
+    r64 allocations_per_op;     // -1 when allocations aren't counted
+    r64 bytes_per_op;
+} Bench_Result;
+
+static int
+compare_r64(const void* a, const void* b)
+{
+    r64 x = *(const r64*)a;
+    r64 y = *(const r64*)b;
+    return (x > y) - (x < y);
+}
+
+// Doubles the iterations until a run takes at least the minimum time, then
+// times repeat runs of that size
+static Bench_Result
+bench_case(Bench_Case* bench, r64 min_time_us, s32 repeat)
+{
+    Bench_Result result = {0};
+    result.name = bench->name;
+
+    s64 iterations = 1;
+    for (;;) {
+        r64 start = os_time_us();
+        bench->run(iterations);
+        r64 elapsed = os_time_us() - start;
+        if (elapsed >= min_time_us)
+            break;
+        // Jump close to the target once a run is long enough to be trusted
+        if (elapsed > min_time_us / 100.0)
+            iterations = (s64)(iterations * (min_time_us / elapsed) * 1.1) + 1;
+        else
+            iterations *= 2;
+    }
+
+    r64 samples[BENCH_MAX_RUNS];
+    s64 allocations = bench_allocations;
+    s64 allocated_bytes = bench_allocated_bytes;
+    for (s32 i = 0; i < repeat; ++i) {
+        r64 start = os_time_us();
+        result.ops = bench->run(iterations);
+        r64 elapsed = os_time_us() - start;
+        samples[i] = (elapsed * 1000.0) / (r64)result.ops;
+    }
+    allocations = bench_allocations - allocations;
+    allocated_bytes = bench_allocated_bytes - allocated_bytes;
+
+    qsort(samples, repeat, sizeof(r64), compare_r64);
+    result.ns_per_op = samples[repeat / 2];
+    result.min_ns_per_op = samples[0];
+#if defined(BENCH_COUNT_ALLOCATIONS)
+    result.allocations_per_op = (r64)allocations / (r64)(result.ops * repeat);
+    result.bytes_per_op = (r64)allocated_bytes / (r64)(result.ops * repeat);
+#else
+    result.allocations_per_op = -1;
+    result.bytes_per_op = -1;
+#endif
+    return result;
+}
+
+static void
+print_usage()
+{
+    printf("usage: bench [-json] [-time <ms>] [-repeat <n>] [filter]\n");
+}
+
+int
+main(int argc, char** argv)
+{
+    bool json = false;
+    r64 min_time_ms = 100.0;
+    s32 repeat = 5;
+    const char* filter = 0;
+
+    for (s32 i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-json") == 0) {
+            json = true;
+        } else if (strcmp(argv[i], "-time") == 0 && i + 1 < argc) {
+            min_time_ms = atof(argv[++i]);
+        } else if (strcmp(argv[i], "-repeat") == 0 && i + 1 < argc) {
+            repeat = atoi(argv[++i]);
+        } else if (argv[i][0] == '-') {
+            print_usage();
+            return 1;
+        } else {
+            filter = argv[i];
+        }
+    }
+    if (repeat < 1) repeat = 1;
+    if (repeat > BENCH_MAX_RUNS) repeat = BENCH_MAX_RUNS;
+
+    fixtures_init();
+
+    s32 case_count = sizeof(bench_cases) / sizeof(*bench_cases);
+    if (json)
+        printf("{\n  \"time_ms\": %.0f,\n  \"repeat\": %d,\n  \"benchmarks\": [", min_time_ms, repeat);
+    else
+        printf("%-40s %12s %12s %10s %10s\n", "case", "ns/op", "min ns/op", "allocs/op", "bytes/op");
+
+    bool first = true;
+    for (s32 i = 0; i < case_count; ++i) {
+        if (filter && !strstr(bench_cases[i].name, filter))
+            continue;
+
+        Bench_Result r = bench_case(&bench_cases[i], min_time_ms * 1000.0, repeat);
+        if (json) {
+            printf("%s\n    { \"name\": \"%s\", \"ops\": %lld, \"ns_per_op\": %.3f, \"min_ns_per_op\": %.3f, \"allocations_per_op\": %.4f, \"bytes_per_op\": %.2f }",
+                (first) ? "" : ",", r.name, r.ops, r.ns_per_op, r.min_ns_per_op, r.allocations_per_op, r.bytes_per_op);
+        } else {
+            printf("%-40s %12.1f %12.1f %10.3f %10.1f\n", r.name, r.ns_per_op, r.min_ns_per_op, r.allocations_per_op, r.bytes_per_op);
+        }
+        fflush(stdout);
+        first = false;
+    }
+    if (json)
+        printf("\n  ]\n}\n");
+    return 0;
+}
@@ -0,0 +1,9 @@
+@echo off
+
+if not exist bin\ (
+    mkdir bin
+)
+
+pushd bin
+cl /nologo /O2 /I../.. /I../../include /I../../server/include ../bench.c ../../game.c ../../eval.c ../../fen.c ../../bitboard.c ../../movepick.c ../../see.c ../../movebatch.c ../../config_parser.c ../../os.c ../../os_file.c /Fe:bench.exe /link user32.lib
+popd
@@ -0,0 +1,191 @@
+#include "bitboard.h"
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+u64 bb_knight_attacks[64];
+u64 bb_king_attacks[64];
+u64 bb_pawn_attacks[2][64];
+u64 bb_between[64][64];
+u64 bb_line[64][64];
+
+Bb_Magic bb_rook_magics[64];
+Bb_Magic bb_bishop_magics[64];
+bool     bb_use_pext;
+
+// Every relevant occupancy subset of every square, 4096 per rook square at most
+// and 512 per bishop square, summed over the board.
+static u64 rook_table[102400];
+static u64 bishop_table[5248];
+
+static const s32 rook_dx[4]   = { 0, 0, 1, -1 };
+static const s32 rook_dy[4]   = { 1, -1, 0, 0 };
+static const s32 bishop_dx[4] = { 1, -1, 1, -1 };
+static const s32 bishop_dy[4] = { 1, 1, -1, -1 };
+
+static u64
+step_mask(s32 x, s32 y, const s32* dx, const s32* dy, s32 count)
+{
+    u64 result = 0;
+    for(s32 i = 0; i < count; ++i) {
+        s32 tx = x + dx[i];
+        s32 ty = y + dy[i];
+        if(tx >= 0 && tx < 8 && ty >= 0 && ty < 8)
+            result |= BB_SQUARE(tx, ty);
+    }
+    return result;
+}
+
+// Walks the rays one square at a time, only used to fill the lookup tables
+static u64
+sliding_attacks(s32 square, u64 occupancy, const s32* dx, const s32* dy)
+{
+    u64 result = 0;
+    for(s32 dir = 0; dir < 4; ++dir) {
+        for(s32 x = square % 8 + dx[dir], y = square / 8 + dy[dir]; x >= 0 && x < 8 && y >= 0 && y < 8; x += dx[dir], y += dy[dir]) {
+            result |= BB_SQUARE(x, y);
+            if(occupancy & BB_SQUARE(x, y))
+                break;
+        }
+    }
+    return result;
+}
+
+static bool
+cpu_has_bmi2()
+{
+#if defined(BB_HAS_PEXT) && defined(_MSC_VER)
+    int regs[4] = {0};
+    __cpuid(regs, 0);
+    if(regs[0] < 7)
+        return false;
+    __cpuidex(regs, 7, 0);
+    return (regs[1] & (1 << 8)) != 0;
+#elif defined(BB_HAS_PEXT)
+    unsigned int eax, ebx, ecx, edx;
+    if(!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+        return false;
+    return (ebx & (1 << 8)) != 0;
+#else
+    return false;
+#endif
+}
+
+static u64
+random_u64(u64* state)
+{
+    // xorshift64*
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 2685821657736338717ULL;
+}
+
+// Fills the attack table of one square and, when not using PEXT, searches a magic
+// multiplier that maps every occupancy subset to a slot without destructive collisions.
+// Returns the number of table entries used.
+static s32
+init_slider_square(Bb_Magic* m, s32 square, u64* table, const s32* dx, const s32* dy, u64* seed)
+{
+    static u64 occupancies[4096];
+    static u64 attacks[4096];
+    static s32 epoch[4096];
+    static s32 current_epoch;
+
+    s32 x = square % 8, y = square / 8;
+    u64 edges = ((BB_RANK_1 | BB_RANK_8) & ~(BB_RANK_1 << (8 * y))) | ((BB_FILE_A | BB_FILE_H) & ~(BB_FILE_A << x));
+    m->mask = sliding_attacks(square, 0, dx, dy) & ~edges;
+    m->shift = 64 - bb_popcount(m->mask);
+    m->attacks = table;
+
+    // Carry-Rippler enumeration of all subsets of the mask
+    s32 size = 0;
+    u64 subset = 0;
+    do {
+        occupancies[size] = subset;
+        attacks[size] = sliding_attacks(square, subset, dx, dy);
+        size++;
+        subset = (subset - m->mask) & m->mask;
+    } while(subset);
+
+#if defined(BB_HAS_PEXT)
+    if(bb_use_pext) {
+        for(s32 i = 0; i < size; ++i)
+            table[bb_pext(occupancies[i], m->mask)] = attacks[i];
+        return size;
+    }
+#endif
+
+    for(;;) {
+        m->magic = random_u64(seed) & random_u64(seed) & random_u64(seed);
+        if(bb_popcount((m->mask * m->magic) & 0xFF00000000000000ULL) < 6)
+            continue;
+
+        current_epoch++;
+        s32 i = 0;
+        for(; i < size; ++i) {
+            u64 index = ((occupancies[i] & m->mask) * m->magic) >> m->shift;
+            if(epoch[index] < current_epoch) {
+                epoch[index] = current_epoch;
+                table[index] = attacks[i];
+            } else if(table[index] != attacks[i]) {
+                break;
+            }
+        }
+        if(i == size)
+            return size;
+    }
+}
+
+void
+bitboard_init()
+{
+    static bool initialized = false;
+    if(initialized) return;
+    initialized = true;
+
+    static const s32 knight_dx[8] = { 1, 2, 2, 1, -1, -2, -2, -1 };
+    static const s32 knight_dy[8] = { 2, 1, -1, -2, -2, -1, 1, 2 };
+    static const s32 king_dx[8]   = { 1, 1, 0, -1, -1, -1, 0, 1 };
+    static const s32 king_dy[8]   = { 0, 1, 1, 1, 0, -1, -1, -1 };
+    static const s32 pawn_dx[2]   = { -1, 1 };
+    static const s32 white_dy[2]  = { 1, 1 };
+    static const s32 black_dy[2]  = { -1, -1 };
+
+    for(s32 y = 0; y < 8; ++y) {
+        for(s32 x = 0; x < 8; ++x) {
+            s32 square = y * 8 + x;
+            bb_knight_attacks[square] = step_mask(x, y, knight_dx, knight_dy, 8);
+            bb_king_attacks[square] = step_mask(x, y, king_dx, king_dy, 8);
+            bb_pawn_attacks[0][square] = step_mask(x, y, pawn_dx, white_dy, 2);
+            bb_pawn_attacks[1][square] = step_mask(x, y, pawn_dx, black_dy, 2);
+        }
+    }
+
+    bb_use_pext = cpu_has_bmi2();
+
+    // Fixed seed so the magics, and therefore the table layout, are the same every run
+    u64 seed = 0x9E3779B97F4A7C15ULL;
+    s32 rook_offset = 0, bishop_offset = 0;
+    for(s32 square = 0; square < 64; ++square) {
+        rook_offset += init_slider_square(&bb_rook_magics[square], square, rook_table + rook_offset, rook_dx, rook_dy, &seed);
+        bishop_offset += init_slider_square(&bb_bishop_magics[square], square, bishop_table + bishop_offset, bishop_dx, bishop_dy, &seed);
+    }
+
+    for(s32 a = 0; a < 64; ++a) {
+        for(s32 b = 0; b < 64; ++b) {
+            if(a == b) continue;
+            u64 ends = (1ULL << a) | (1ULL << b);
+            if(bb_rook_attacks(a, 0) & (1ULL << b)) {
+                bb_line[a][b] = (bb_rook_attacks(a, 0) & bb_rook_attacks(b, 0)) | ends;
+                bb_between[a][b] = bb_rook_attacks(a, 1ULL << b) & bb_rook_attacks(b, 1ULL << a);
+            } else if(bb_bishop_attacks(a, 0) & (1ULL << b)) {
+                bb_line[a][b] = (bb_bishop_attacks(a, 0) & bb_bishop_attacks(b, 0)) | ends;
+                bb_between[a][b] = bb_bishop_attacks(a, 1ULL << b) & bb_bishop_attacks(b, 1ULL << a);
+            }
+        }
+    }
+}
@@ -0,0 +1,130 @@
+#pragma once
+#include "types.h"
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+// PEXT is only available on x86-64, define BB_NO_PEXT to always use multiply magics
+#if !defined(BB_NO_PEXT) && (defined(_M_X64) || defined(__x86_64__))
+#define BB_HAS_PEXT
+#if defined(_MSC_VER)
+#include <immintrin.h>
+#endif
+#endif
+
+// Squares are indexed as y * 8 + x, the same layout as Game.board[y][x],
+// so bit 0 is a1 and bit 63 is h8.
+#define BB_SQUARE(X, Y) (1ULL << ((Y) * 8 + (X)))
+
+#define BB_FILE_A 0x0101010101010101ULL
+#define BB_FILE_H 0x8080808080808080ULL
+#define BB_RANK_1 0x00000000000000FFULL
+#define BB_RANK_8 0xFF00000000000000ULL
+#define BB_DARK_SQUARES 0xAA55AA55AA55AA55ULL
+
+extern u64 bb_knight_attacks[64];
+extern u64 bb_king_attacks[64];
+extern u64 bb_pawn_attacks[2][64]; // indexed by Chess_Color
+extern u64 bb_between[64][64];     // squares strictly between two aligned squares
+extern u64 bb_line[64][64];        // whole rank, file or diagonal through two aligned squares
+
+// Slider attacks of one square, indexed either by PEXT of the occupancy over the
+// relevant mask or by the multiply-magic hash of it.
+typedef struct {
+    u64* attacks;
+    u64  mask;
+    u64  magic;
+    s32  shift;
+} Bb_Magic;
+
+extern Bb_Magic bb_rook_magics[64];
+extern Bb_Magic bb_bishop_magics[64];
+extern bool     bb_use_pext; // chosen from CPUID in bitboard_init
+
+void bitboard_init();
+
+#if defined(BB_HAS_PEXT)
+static inline u64
+bb_pext(u64 value, u64 mask)
+{
+#if defined(_MSC_VER)
+    return _pext_u64(value, mask);
+#else
+    // Inline assembly so the rest of the file does not need to be built with -mbmi2
+    u64 result;
+    __asm__("pextq %2, %1, %0" : "=r"(result) : "r"(value), "r"(mask));
+    return result;
+#endif
+}
+#endif
+
+static inline u64
+bb_slider_attacks(const Bb_Magic* m, u64 occupancy)
+{
+#if defined(BB_HAS_PEXT)
+    if (bb_use_pext)
+        return m->attacks[bb_pext(occupancy, m->mask)];
+#endif
+    return m->attacks[((occupancy & m->mask) * m->magic) >> m->shift];
+}
+
+static inline u64
+bb_bishop_attacks(s32 square, u64 occupancy)
+{
+    return bb_slider_attacks(&bb_bishop_magics[square], occupancy);
+}
+
+static inline u64
+bb_rook_attacks(s32 square, u64 occupancy)
+{
+    return bb_slider_attacks(&bb_rook_magics[square], occupancy);
+}
+
+static inline u64
+bb_queen_attacks(s32 square, u64 occupancy)
+{
+    return bb_bishop_attacks(square, occupancy) | bb_rook_attacks(square, occupancy);
+}
+
+static inline s32
+bb_popcount(u64 bb)
+{
+#if defined(_MSC_VER)
+    return (s32)__popcnt64(bb);
+#else
+    return __builtin_popcountll(bb);
+#endif
+}
+
+static inline s32
+bb_lsb(u64 bb)
+{
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward64(&index, bb);
+    return (s32)index;
+#else
+    return __builtin_ctzll(bb);
+#endif
+}
+
+static inline s32
+bb_msb(u64 bb)
+{
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanReverse64(&index, bb);
+    return (s32)index;
+#else
+    return 63 - __builtin_clzll(bb);
+#endif
+}
+
+static inline s32
+bb_pop_lsb(u64* bb)
+{
+    s32 square = bb_lsb(*bb);
+    *bb &= *bb - 1;
+    return square;
+}
@@ -0,0 +1,279 @@
+#include <stdio.h>
+#include <string.h>
+#include "types.h"
+#include "game.h"
+#include "eval.h"
+
+// Piece kinds in Chess_Piece order
+#define EVAL_KINDS 6
+
+s32 eval_psq[CHESS_COUNT][64][2];
+
+static const char* kind_name[EVAL_KINDS] = { "king", "queen", "rook", "knight", "bishop", "pawn" };
+
+// Contribution of every kind to the game phase, knights and bishops 1, rooks 2, queens 4
+static const s32 kind_phase[EVAL_KINDS] = { 0, 4, 2, 1, 1, 0 };
+
+// Piece values and piece-square tables, indexed by kind and Eval_Stage. The
+// tables are from white's side with rank 8 first, as a board diagram reads.
+// The defaults are the PeSTO tables, eval_load replaces them.
+static s32 kind_value[EVAL_KINDS][2] = {
+    { 0, 0 }, { 1025, 936 }, { 477, 512 }, { 337, 281 }, { 365, 297 }, { 82, 94 },
+};
+
+static s32 kind_table[EVAL_KINDS][2][64] = {
+    // King
+    {{
+        -65,  23,  16, -15, -56, -34,   2,  13,
+         29,  -1, -20,  -7,  -8,  -4, -38, -29,
+         -9,  24,   2, -16, -20,   6,  22, -22,
+        -17, -20, -12, -27, -30, -25, -14, -36,
+        -49,  -1, -27, -39, -46, -44, -33, -51,
+        -14, -14, -22, -46, -44, -30, -15, -27,
+          1,   7,  -8, -64, -43, -16,   9,   8,
+        -15,  36,  12, -54,   8, -28,  24,  14,
+    }, {
+        -74, -35, -18, -18, -11,  15,   4, -17,
+        -12,  17,  14,  17,  17,  38,  23,  11,
+         10,  17,  23,  15,  20,  45,  44,  13,
+         -8,  22,  24,  27,  26,  33,  26,   3,
+        -18,  -4,  21,  24,  27,  23,   9, -11,
+        -19,  -3,  11,  21,  23,  16,   7,  -9,
+        -27, -11,   4,  13,  14,   4,  -5, -17,
+        -53, -34, -21, -11, -28, -14, -24, -43,
+    }},
+    // Queen
+    {{
+        -28,   0,  29,  12,  59,  44,  43,  45,
+        -24, -39,  -5,   1, -16,  57,  28,  54,
+        -13, -17,   7,   8,  29,  56,  47,  57,
+        -27, -27, -16, -16,  -1,  17,  -2,   1,
+         -9, -26,  -9, -10,  -2,  -4,   3,  -3,
+        -14,   2, -11,  -2,  -5,   2,  14,   5,
+        -35,  -8,  11,   2,   8,  15,  -3,   1,
+         -1, -18,  -9,  10, -15, -25, -31, -50,
+    }, {
+         -9,  22,  22,  27,  27,  19,  10,  20,
+        -17,  20,  32,  41,  58,  25,  30,   0,
+        -20,   6,   9,  49,  47,  35,  19,   9,
+          3,  22,  24,  45,  57,  40,  57,  36,
+        -18,  28,  19,  47,  31,  34,  39,  23,
+        -16, -27,  15,   6,   9,  17,  10,   5,
+        -22, -23, -30, -16, -16, -23, -36, -32,
+        -33, -28, -22, -43,  -5, -32, -20, -41,
+    }},
+    // Rook
+    {{
+         32,  42,  32,  51,  63,   9,  31,  43,
+         27,  32,  58,  62,  80,  67,  26,  44,
+         -5,  19,  26,  36,  17,  45,  61,  16,
+        -24, -11,   7,  26,  24,  35,  -8, -20,
+        -36, -26, -12,  -1,   9,  -7,   6, -23,
+        -45, -25, -16, -17,   3,   0,  -5, -33,
+        -44, -16, -20,  -9,  -1,  11,  -6, -71,
+        -19, -13,   1,  17,  16,   7, -37, -26,
+    }, {
+         13,  10,  18,  15,  12,  12,   8,   5,
+         11,  13,  13,  11,  -3,   3,   8,   3,
+          7,   7,   7,   5,   4,  -3,  -5,  -3,
+          4,   3,  13,   1,   2,   1,  -1,   2,
+          3,   5,   8,   4,  -5,  -6,  -8, -11,
+         -4,   0,  -5,  -1,  -7, -12,  -8, -16,
+         -6,  -6,   0,   2,  -9,  -9, -11,  -3,
+         -9,   2,   3,  -1,  -5, -13,   4, -20,
+    }},
+    // Knight
+    {{
+       -167, -89, -34, -49,  61, -97, -15,-107,
+        -73, -41,  72,  36,  23,  62,   7, -17,
+        -47,  60,  37,  65,  84, 129,  73,  44,
+         -9,  17,  19,  53,  37,  69,  18,  22,
+        -13,   4,  16,  13,  28,  19,  21,  -8,
+        -23,  -9,  12,  10,  19,  17,  25, -16,
+        -29, -53, -12,  -3,  -1,  18, -14, -19,
+       -105, -21, -58, -33, -17, -28, -19, -23,
+    }, {
+        -58, -38, -13, -28, -31, -27, -63, -99,
+        -25,  -8, -25,  -2,  -9, -25, -24, -52,
+        -24, -20,  10,   9,  -1,  -9, -19, -41,
+        -17,   3,  22,  22,  22,  11,   8, -18,
+        -18,  -6,  16,  25,  16,  17,   4, -18,
+        -23,  -3,  -1,  15,  10,  -3, -20, -22,
+        -42, -20, -10,  -5,  -2, -20, -23, -44,
+        -29, -51, -23, -15, -22, -18, -50, -64,
+    }},
+    // Bishop
+    {{
+        -29,   4, -82, -37, -25, -42,   7,  -8,
+        -26,  16, -18, -13,  30,  59,  18, -47,
+        -16,  37,  43,  40,  35,  50,  37,  -2,
+         -4,   5,  19,  50,  37,  37,   7,  -2,
+         -6,  13,  13,  26,  34,  12,  10,   4,
+          0,  15,  15,  15,  14,  27,  18,  10,
+          4,  15,  16,   0,   7,  21,  33,   1,
+        -33,  -3, -14, -21, -13, -12, -39, -21,
+    }, {
+        -14, -21, -11,  -8,  -7,  -9, -17, -24,
+         -8,  -4,   7, -12,  -3, -13,  -4, -14,
+          2,  -8,   0,  -1,  -2,   6,   0,   4,
+         -3,   9,  12,   9,  14,  10,   3,   2,
+         -6,   3,  13,  19,   7,  10,  -3,  -9,
+        -12,  -3,   8,  10,  13,   3,  -7, -15,
+        -14, -18,  -7,  -1,   4,  -9, -15, -27,
+        -23,  -9, -23,  -5,  -9, -16,  -5, -17,
+    }},
+    // Pawn
+    {{
+          0,   0,   0,   0,   0,   0,   0,   0,
+         98, 134,  61,  95,  68, 126,  34, -11,
+         -6,   7,  26,  31,  65,  56,  25, -20,
+        -14,  13,   6,  21,  23,  12,  17, -23,
+        -27,  -2,  -5,  12,  17,   6,  10, -25,
+        -26,  -4,  -4, -10,   3,   3,  33, -12,
+        -35,  -1, -20, -23, -15,  24,  38, -22,
+          0,   0,   0,   0,   0,   0,   0,   0,
+    }, {
+          0,   0,   0,   0,   0,   0,   0,   0,
+        178, 173, 158, 134, 147, 132, 165, 187,
+         94, 100,  85,  67,  56,  53,  82,  84,
+         32,  24,  13,   5,  -2,   4,  17,  17,
+         13,   9,  -3,  -7,  -7,  -8,   3,  -1,
+          4,   7,  -6,   1,   0,  -5,  -1,  -8,
+         13,   8,   8,  10,  13,   0,   2,  -7,
+          0,   0,   0,   0,   0,   0,   0,   0,
+    }},
+};
+
+static const char* stage_name[2] = { "midgame", "endgame" };
+
+// Folds values and tables into eval_psq. A white piece on square reads the
+// diagram at square ^ 56, a black one reads it mirrored, at square itself.
+static void
+eval_build()
+{
+    for (s32 kind = 0; kind < EVAL_KINDS; ++kind) {
+        for (s32 square = 0; square < 64; ++square) {
+            for (s32 stage = 0; stage < 2; ++stage) {
+                eval_psq[CHESS_WHITE_KING + kind][square][stage] = kind_value[kind][stage] + kind_table[kind][stage][square ^ 56];
+                eval_psq[CHESS_BLACK_KING + kind][square][stage] = -(kind_value[kind][stage] + kind_table[kind][stage][square]);
+            }
+        }
+    }
+}
+
+void
+eval_init()
+{
+    static bool initialized = false;
+    if(initialized) return;
+    initialized = true;
+    eval_build();
+}
+
+static s32
+find_name(const char** names, s32 count, const char* name)
+{
+    for (s32 i = 0; i < count; ++i) {
+        if (strcmp(names[i], name) == 0)
+            return i;
+    }
+    return -1;
+}
+
+// Reads values and tables written by eval_save, lines starting with # are comments:
+//   value <kind> <midgame> <endgame>
+//   <midgame|endgame> <kind> followed by 64 numbers, rank 8 first
+// Kinds and stages missing from the file keep their values. Nothing changes if
+// the file can't be parsed. Positions set up before only change after position_sync.
+bool
+eval_load(const char* path)
+{
+    FILE* file = fopen(path, "r");
+    if (!file)
+        return false;
+
+    s32 value[EVAL_KINDS][2];
+    s32 table[EVAL_KINDS][2][64];
+    memcpy(value, kind_value, sizeof(value));
+    memcpy(table, kind_table, sizeof(table));
+
+    bool ok = true;
+    char word[32], name[32];
+    while (ok && fscanf(file, "%31s", word) == 1) {
+        if (word[0] == '#') {
+            s32 c;
+            while ((c = fgetc(file)) != EOF && c != '\n');
+            continue;
+        }
+
+        ok = (fscanf(file, "%31s", name) == 1);
+        s32 kind = (ok) ? find_name(kind_name, EVAL_KINDS, name) : -1;
+        s32 stage = find_name(stage_name, 2, word);
+        if (kind < 0) {
+            ok = false;
+        } else if (strcmp(word, "value") == 0) {
+            ok = (fscanf(file, "%d %d", &value[kind][EVAL_MIDGAME], &value[kind][EVAL_ENDGAME]) == 2);
+        } else if (stage >= 0) {
+            for (s32 i = 0; ok && i < 64; ++i)
+                ok = (fscanf(file, "%d", &table[kind][stage][i]) == 1);
+        } else {
+            ok = false;
+        }
+    }
+    fclose(file);
+
+    if (!ok)
+        return false;
+    memcpy(kind_value, value, sizeof(value));
+    memcpy(kind_table, table, sizeof(table));
+    eval_build();
+    return true;
+}
+
+// Writes the values and tables in use, the starting point for tuning them
+bool
+eval_save(const char* path)
+{
+    FILE* file = fopen(path, "w");
+    if (!file)
+        return false;
+
+    fprintf(file, "# Piece values and piece-square tables, from white's side with rank 8 first\n");
+    for (s32 kind = 0; kind < EVAL_KINDS; ++kind)
+        fprintf(file, "value %s %d %d\n", kind_name[kind], kind_value[kind][EVAL_MIDGAME], kind_value[kind][EVAL_ENDGAME]);
+    for (s32 kind = 0; kind < EVAL_KINDS; ++kind) {
+        for (s32 stage = 0; stage < 2; ++stage) {
+            fprintf(file, "\n%s %s\n", stage_name[stage], kind_name[kind]);
+            for (s32 i = 0; i < 64; ++i)
+                fprintf(file, "%5d%s", kind_table[kind][stage][i], (i % 8 == 7) ? "\n" : "");
+        }
+    }
+    fclose(file);
+    return true;
+}
+
+// From the material signature, EVAL_PHASE_MAX with every piece on the board
+// down to 0 with only kings and pawns. Promotions can push it over, it is capped.
+s32
+eval_phase(Position* pos)
+{
+    u64 m = pos->material;
+    s32 phase = 0;
+    for (s32 color = 0; color < 2; ++color) {
+        phase += kind_phase[CHESS_WHITE_KNIGHT - CHESS_WHITE_KING] * (s32)MATERIAL_COUNT(m, color, MATERIAL_KNIGHT);
+        phase += kind_phase[CHESS_WHITE_BISHOP - CHESS_WHITE_KING] *
+            (s32)(MATERIAL_COUNT(m, color, MATERIAL_LIGHT_BISHOP) + MATERIAL_COUNT(m, color, MATERIAL_DARK_BISHOP));
+        phase += kind_phase[CHESS_WHITE_ROOK - CHESS_WHITE_KING] * (s32)MATERIAL_COUNT(m, color, MATERIAL_ROOK);
+        phase += kind_phase[CHESS_WHITE_QUEEN - CHESS_WHITE_KING] * (s32)MATERIAL_COUNT(m, color, MATERIAL_QUEEN);
+    }
+    return (phase < EVAL_PHASE_MAX) ? phase : EVAL_PHASE_MAX;
+}
+
+// Midgame and endgame sums blended by the phase, for the side to move
+s32
+eval_position(Position* pos)
+{
+    s32 phase = eval_phase(pos);
+    s32 score = (pos->psq[EVAL_MIDGAME] * phase + pos->psq[EVAL_ENDGAME] * (EVAL_PHASE_MAX - phase)) / EVAL_PHASE_MAX;
+    return (pos->white_turn) ? score : -score;
+}
@@ -0,0 +1,20 @@
+#pragma once
+#include "types.h"
+#include "game.h"
+
+#define EVAL_PHASE_MAX 24   // game phase with all the pieces on the board, 0 is a bare endgame
+
+typedef enum {
+    EVAL_MIDGAME = 0,
+    EVAL_ENDGAME = 1,
+} Eval_Stage;
+
+// Value of a piece on a square, material plus the piece-square bonus, for each
+// Eval_Stage. Black pieces are negative. set_piece keeps their sums in Position.psq.
+extern s32 eval_psq[CHESS_COUNT][64][2];
+
+void eval_init();
+bool eval_load(const char* path);
+bool eval_save(const char* path);
+s32  eval_phase(Position* pos);
+s32  eval_position(Position* pos);
@@ -1,5 +1,6 @@
-#include "os.h"
+#include "types.h"
 #include "game.h"
+#include <string.h>
 
 typedef enum {
 	FEN_BOARD,
@@ -23,16 +24,27 @@ is_whitespace(char c)
 	return (c == ' ' || c == '\v' || c == '\f' || c == '\t' || c == '\r');
 }
 
+// Local so the FEN parser links without the config parser and its UI dependencies
+static s32
+parse_number(const s8* text, s32 length)
+{
+	s32 result = 0;
+	for (s32 i = 0; i < length && is_number(text[i]); ++i)
+		result = result * 10 + (text[i] - '0');
+	return result;
+}
+
 s32 parse_fen(s8* fen, Game* game) {
 	// startpos
 	// rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1
 
-	memset(game->board, CHESS_NONE, sizeof(game->board));
-    game->move_draw_count = 0;
-    game->white_long_castle_valid = false;
-    game->white_short_castle_valid = false;
-    game->black_long_castle_valid = false;
-    game->black_short_castle_valid = false;
+	memset(game->pos.board, CHESS_NONE, sizeof(game->pos.board));
+    game->pos.move_draw_count = 0;
+    game->pos.en_passant_square = -1;
+    game->pos.white_long_castle_valid = false;
+    game->pos.white_short_castle_valid = false;
+    game->pos.black_long_castle_valid = false;
+    game->pos.black_short_castle_valid = false;
 
 	Fen_Format parsing_state = FEN_BOARD;
 
@@ -50,19 +62,19 @@ s32 parse_fen(s8* fen, Game* game) {
 			case FEN_BOARD: {
 				switch (c) 
 				{
-					case 'r':	game->board[rank][file] = CHESS_BLACK_ROOK; break;
-					case 'n':	game->board[rank][file] = CHESS_BLACK_KNIGHT; break;
-					case 'b':	game->board[rank][file] = CHESS_BLACK_BISHOP; break;
-					case 'q':	game->board[rank][file] = CHESS_BLACK_QUEEN; break;
-					case 'k':	game->board[rank][file] = CHESS_BLACK_KING; break;
-					case 'p':	game->board[rank][file] = CHESS_BLACK_PAWN; break;
-
-					case 'R':	game->board[rank][file] = CHESS_WHITE_ROOK; break;
-					case 'N':	game->board[rank][file] = CHESS_WHITE_KNIGHT; break;
-					case 'B':	game->board[rank][file] = CHESS_WHITE_BISHOP; break;
-					case 'Q':	game->board[rank][file] = CHESS_WHITE_QUEEN; break;
-					case 'K':	game->board[rank][file] = CHESS_WHITE_KING; break;
-					case 'P':	game->board[rank][file] = CHESS_WHITE_PAWN; break;
+					case 'r':	game->pos.board[rank][file] = CHESS_BLACK_ROOK; break;
+					case 'n':	game->pos.board[rank][file] = CHESS_BLACK_KNIGHT; break;
+					case 'b':	game->pos.board[rank][file] = CHESS_BLACK_BISHOP; break;
+					case 'q':	game->pos.board[rank][file] = CHESS_BLACK_QUEEN; break;
+					case 'k':	game->pos.board[rank][file] = CHESS_BLACK_KING; break;
+					case 'p':	game->pos.board[rank][file] = CHESS_BLACK_PAWN; break;
+
+					case 'R':	game->pos.board[rank][file] = CHESS_WHITE_ROOK; break;
+					case 'N':	game->pos.board[rank][file] = CHESS_WHITE_KNIGHT; break;
+					case 'B':	game->pos.board[rank][file] = CHESS_WHITE_BISHOP; break;
+					case 'Q':	game->pos.board[rank][file] = CHESS_WHITE_QUEEN; break;
+					case 'K':	game->pos.board[rank][file] = CHESS_WHITE_KING; break;
+					case 'P':	game->pos.board[rank][file] = CHESS_WHITE_PAWN; break;
 
 					case '/': {
 						rank -= 1;
@@ -73,7 +85,7 @@ s32 parse_fen(s8* fen, Game* game) {
 						if (is_number(c)) {
 							s32 start = 0;
 							while (start < (c - 0x30) - 1) {
-								game->board[rank][file] = CHESS_NONE;
+								game->pos.board[rank][file] = CHESS_NONE;
 								start++;
 								file++;
 							}
@@ -90,9 +102,9 @@ s32 parse_fen(s8* fen, Game* game) {
 
 			case FEN_TO_MOVE: {
 				if (c == 'w')
-                    game->white_turn = true;
+                    game->pos.white_turn = true;
 				else if (c == 'b')
-					game->white_turn = false;
+					game->pos.white_turn = false;
 				else
 					return -1;
 				parsing_state = FEN_CASTLING;
@@ -105,10 +117,10 @@ s32 parse_fen(s8* fen, Game* game) {
 						break;
                     
 					switch (c) {
-						case 'K': game->white_short_castle_valid = true; break;
-						case 'Q': game->white_long_castle_valid = true; break;
-						case 'k': game->black_short_castle_valid = true; break;
-						case 'q': game->black_long_castle_valid = true; break;
+						case 'K': game->pos.white_short_castle_valid = true; break;
+						case 'Q': game->pos.white_long_castle_valid = true; break;
+						case 'k': game->pos.black_short_castle_valid = true; break;
+						case 'q': game->pos.black_long_castle_valid = true; break;
 						default: return -1;
 					}
 					++fen;
@@ -123,19 +135,8 @@ s32 parse_fen(s8* fen, Game* game) {
 					if (c >= 'a' && c <= 'h') {
 						//state->en_passant_file = c - 0x61;
                         int file = c - 0x61;
-                        if(game->white_turn) {
-                            game->last_move.from_x = file;
-                            game->last_move.from_y = 6;
-                            game->last_move.to_x = file;
-                            game->last_move.to_y = 4;
-                            game->last_move.moved_piece = CHESS_BLACK_PAWN;
-                        } else {
-                            game->last_move.from_x = file;
-                            game->last_move.from_y = 1;
-                            game->last_move.to_x = file;
-                            game->last_move.to_y = 3;
-                            game->last_move.moved_piece = CHESS_WHITE_PAWN;
-                        }
+                        // The target square is behind the pawn that just moved two squares
+                        game->pos.en_passant_square = (game->pos.white_turn) ? (5 * 8 + file) : (2 * 8 + file);
 					}
 					fen++;	// skip rank
 					parsing_state = FEN_HALFMOVE;
@@ -144,8 +145,8 @@ s32 parse_fen(s8* fen, Game* game) {
 
 			case FEN_HALFMOVE: {
 				s32 length = 0;
-				while (!is_whitespace(*(fen + length))) length++;
-                game->move_draw_count = parse_int(fen, length);
+				while (!is_whitespace(*(fen + length)) && *(fen + length)) length++;
+                game->pos.move_draw_count = parse_number(fen, length);
 				parsing_state = FEN_FULLMOVE;
 			}break;
 
@@ -156,11 +157,15 @@ s32 parse_fen(s8* fen, Game* game) {
 				parsing_state = FEN_END;
 			}break;
 
-			case FEN_END: return 0;
+			case FEN_END: {
+				game_sync_bitboards(game);
+				return 0;
+			}
 		}
 		
 		++fen;
 	}
 
+	game_sync_bitboards(game);
 	return 0;
 }
\ No newline at end of file
@@ -1,54 +1,172 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "game.h"
+#include "bitboard.h"
+#include "eval.h"
 #include <light_array.h>
 
 #define MAX(A, B) (((A) > (B)) ? (A) : (B))
 #define MIN(A, B) (((A) < (B)) ? (A) : (B))
 
-s32 generate_possible_moves(Game* game, Gen_Moves* moves);
 bool check_sufficient_material(Game* game);
 bool check_repetition(Game* game);
 
+static u64 zobrist_piece[CHESS_COUNT][64];
+static u64 zobrist_castle[16];     // indexed by the CASTLE_* bits
+static u64 zobrist_en_passant[8];  // indexed by file
+static u64 zobrist_black_turn;
+
+static u64 material_unit[CHESS_COUNT][64];  // signature increment of a piece on a square
+static u8  material_table[1 << 12];         // Material_Class of positions with only minor pieces
+
+static s32
+material_index(u64 material)
+{
+    // 2 bits per minor piece field, counts above 3 don't change the class
+    s32 index = 0;
+    for (s32 color = 0; color < 2; ++color) {
+        for (s32 field = MATERIAL_KNIGHT; field <= MATERIAL_DARK_BISHOP; ++field) {
+            s32 count = MIN(3, (s32)MATERIAL_COUNT(material, color, field));
+            index = (index << 2) | count;
+        }
+    }
+    return index;
+}
+
+static Material_Class
+classify_minors(s32 knights[2], s32 light[2], s32 dark[2])
+{
+    s32 minors[2] = { knights[0] + light[0] + dark[0], knights[1] + light[1] + dark[1] };
+
+    // Bishops all on one square color and no knights can never give mate
+    if (knights[0] + knights[1] == 0 && (light[0] + light[1] == 0 || dark[0] + dark[1] == 0))
+        return MATERIAL_INSUFFICIENT;
+    // A lone knight
+    if (minors[0] + minors[1] == 1)
+        return MATERIAL_INSUFFICIENT;
+
+    for (s32 color = 0; color < 2; ++color) {
+        if (minors[!color] != 0)
+            continue;
+        // Against a lone king, two knights can't force mate but anything with a bishop pair or bishop and knight can
+        if (knights[color] == minors[color] && minors[color] == 2)
+            return MATERIAL_DRAWISH;
+        return MATERIAL_MATING;
+    }
+    if (minors[0] == 1 && minors[1] == 1)
+        return MATERIAL_DRAWISH;
+    return MATERIAL_NORMAL;
+}
+
+static void
+material_init()
+{
+    static bool initialized = false;
+    if(initialized) return;
+    initialized = true;
+
+    for (s32 square = 0; square < 64; ++square) {
+        bool dark = (BB_DARK_SQUARES >> square) & 1;
+        for (s32 color = 0; color < 2; ++color) {
+            Chess_Piece king = (color == CHESS_COLOR_WHITE) ? CHESS_WHITE_KING : CHESS_BLACK_KING;
+            material_unit[king + (CHESS_WHITE_PAWN - CHESS_WHITE_KING)][square]   = 1ULL << MATERIAL_SHIFT(color, MATERIAL_PAWN);
+            material_unit[king + (CHESS_WHITE_KNIGHT - CHESS_WHITE_KING)][square] = 1ULL << MATERIAL_SHIFT(color, MATERIAL_KNIGHT);
+            material_unit[king + (CHESS_WHITE_BISHOP - CHESS_WHITE_KING)][square] = 1ULL << MATERIAL_SHIFT(color, (dark) ? MATERIAL_DARK_BISHOP : MATERIAL_LIGHT_BISHOP);
+            material_unit[king + (CHESS_WHITE_ROOK - CHESS_WHITE_KING)][square]   = 1ULL << MATERIAL_SHIFT(color, MATERIAL_ROOK);
+            material_unit[king + (CHESS_WHITE_QUEEN - CHESS_WHITE_KING)][square]  = 1ULL << MATERIAL_SHIFT(color, MATERIAL_QUEEN);
+        }
+    }
+
+    for (s32 index = 0; index < (1 << 12); ++index) {
+        s32 knights[2], light[2], dark[2];
+        for (s32 color = 0; color < 2; ++color) {
+            s32 fields = index >> (6 * (1 - color));
+            knights[color] = (fields >> 4) & 3;
+            light[color] = (fields >> 2) & 3;
+            dark[color] = fields & 3;
+        }
+        material_table[index] = classify_minors(knights, light, dark);
+    }
+}
+
+// Pawns, rooks or queens on the board always leave mating material
+#define MATERIAL_MAJOR_OR_PAWN_MASK \
+    ((0xfULL << MATERIAL_SHIFT(0, MATERIAL_PAWN)) | (0xffULL << MATERIAL_SHIFT(0, MATERIAL_ROOK)) | \
+     (0xfULL << MATERIAL_SHIFT(1, MATERIAL_PAWN)) | (0xffULL << MATERIAL_SHIFT(1, MATERIAL_ROOK)))
+
+Material_Class
+game_material_class(Game* game)
+{
+    if (game->pos.material & MATERIAL_MAJOR_OR_PAWN_MASK)
+        return MATERIAL_NORMAL;
+    return (Material_Class)material_table[material_index(game->pos.material)];
+}
+
+static void
+zobrist_init()
+{
+    static bool initialized = false;
+    if(initialized) return;
+    initialized = true;
+
+    // xorshift64* with a fixed seed, keys must be the same on every client
+    u64 state = 0x2545F4914F6CDD1DULL;
+    u64* keys[] = { &zobrist_piece[0][0], zobrist_castle, zobrist_en_passant, &zobrist_black_turn };
+    s32 counts[] = { CHESS_COUNT * 64, 16, 8, 1 };
+    for(s32 k = 0; k < 4; ++k) {
+        for(s32 i = 0; i < counts[k]; ++i) {
+            state ^= state >> 12;
+            state ^= state << 25;
+            state ^= state >> 27;
+            keys[k][i] = state * 2685821657736338717ULL;
+        }
+    }
+}
+
 void
 game_standard_board(Game* game)
 {
-    memset(game->board, 0, sizeof(game->board));
-    game->move_draw_count = 0;
+    memset(game->pos.board, 0, sizeof(game->pos.board));
+    game->pos.move_draw_count = 0;
 
     for(s32 y = 0; y < 8; ++y)
         for(s32 x = 0; x < 8; ++x)
         {
             switch(y)
             {
-                case 1:  game->board[y][x] = CHESS_WHITE_PAWN; break;
-                case 6:  game->board[y][x] = CHESS_BLACK_PAWN; break;
-                default: game->board[y][x] = CHESS_NONE; break;
+                case 1:  game->pos.board[y][x] = CHESS_WHITE_PAWN; break;
+                case 6:  game->pos.board[y][x] = CHESS_BLACK_PAWN; break;
+                default: game->pos.board[y][x] = CHESS_NONE; break;
             }
         }
 
-    game->board[0][0] = CHESS_WHITE_ROOK;
-    game->board[0][1] = CHESS_WHITE_KNIGHT;
-    game->board[0][2] = CHESS_WHITE_BISHOP;
-    game->board[0][3] = CHESS_WHITE_QUEEN;
-    game->board[0][4] = CHESS_WHITE_KING;
-    game->board[0][5] = CHESS_WHITE_BISHOP;
-    game->board[0][6] = CHESS_WHITE_KNIGHT;
-    game->board[0][7] = CHESS_WHITE_ROOK;
-
-    game->board[7][0] = CHESS_BLACK_ROOK;
-    game->board[7][1] = CHESS_BLACK_KNIGHT;
-    game->board[7][2] = CHESS_BLACK_BISHOP;
-    game->board[7][3] = CHESS_BLACK_QUEEN;
-    game->board[7][4] = CHESS_BLACK_KING;
-    game->board[7][5] = CHESS_BLACK_BISHOP;
-    game->board[7][6] = CHESS_BLACK_KNIGHT;
-    game->board[7][7] = CHESS_BLACK_ROOK;
+    game->pos.board[0][0] = CHESS_WHITE_ROOK;
+    game->pos.board[0][1] = CHESS_WHITE_KNIGHT;
+    game->pos.board[0][2] = CHESS_WHITE_BISHOP;
+    game->pos.board[0][3] = CHESS_WHITE_QUEEN;
+    game->pos.board[0][4] = CHESS_WHITE_KING;
+    game->pos.board[0][5] = CHESS_WHITE_BISHOP;
+    game->pos.board[0][6] = CHESS_WHITE_KNIGHT;
+    game->pos.board[0][7] = CHESS_WHITE_ROOK;
+
+    game->pos.board[7][0] = CHESS_BLACK_ROOK;
+    game->pos.board[7][1] = CHESS_BLACK_KNIGHT;
+    game->pos.board[7][2] = CHESS_BLACK_BISHOP;
+    game->pos.board[7][3] = CHESS_BLACK_QUEEN;
+    game->pos.board[7][4] = CHESS_BLACK_KING;
+    game->pos.board[7][5] = CHESS_BLACK_BISHOP;
+    game->pos.board[7][6] = CHESS_BLACK_KNIGHT;
+    game->pos.board[7][7] = CHESS_BLACK_ROOK;
 
     game->last_move.start = true;
-    game->white_turn = true;
-    game->white_long_castle_valid = true;
-    game->white_short_castle_valid = true;
-    game->black_long_castle_valid = true;
-    game->black_short_castle_valid = true;
+    game->pos.en_passant_square = -1;
+    game->pos.white_turn = true;
+    game->pos.white_long_castle_valid = true;
+    game->pos.white_short_castle_valid = true;
+    game->pos.black_long_castle_valid = true;
+    game->pos.black_short_castle_valid = true;
+    game_sync_bitboards(game);
 
     game->winner = PLAYER_NONE;
 }
@@ -56,19 +174,46 @@ game_standard_board(Game* game)
 void
 game_queen_checkmate_board(Game* game)
 {
-    memset(game->board, 0, sizeof(game->board));
-    game->move_draw_count = 0;
+    memset(game->pos.board, 0, sizeof(game->pos.board));
+    game->pos.move_draw_count = 0;
 
-    game->board[2][2] = CHESS_WHITE_KING;
-    game->board[4][2] = CHESS_WHITE_QUEEN;
-    game->board[2][6] = CHESS_BLACK_KING;
+    game->pos.board[2][2] = CHESS_WHITE_KING;
+    game->pos.board[4][2] = CHESS_WHITE_QUEEN;
+    game->pos.board[2][6] = CHESS_BLACK_KING;
+    game->pos.en_passant_square = -1;
+    game_sync_bitboards(game);
 
     game->winner = PLAYER_NONE;
 }
 
+// Keyframes are heap copies of Game, malloc only promises 16 byte alignment
+static Game*
+keyframe_alloc(void)
+{
+#if defined(_MSC_VER)
+    return _aligned_malloc(sizeof(Game), __alignof(Game));
+#else
+    return aligned_alloc(_Alignof(Game), sizeof(Game));
+#endif
+}
+
+static void
+keyframe_free(Game* keyframe)
+{
+#if defined(_MSC_VER)
+    _aligned_free(keyframe);
+#else
+    free(keyframe);
+#endif
+}
+
 void
 game_new(Game* game)
 {
+    bitboard_init();
+    zobrist_init();
+    material_init();
+    eval_init();
     game_standard_board(game);
     //game_queen_checkmate_board(game);
 
@@ -81,14 +226,20 @@ game_new(Game* game)
     game->im_white = false;
 
     if(game->history) {
-        array_free(((Game_History*)game->history)->game);
+        Game_History* old = (Game_History*)game->history;
+        for (s32 i = 0; i < array_length(old->keyframes); ++i)
+            keyframe_free(old->keyframes[i]);
+        array_free(((Game_History*)game->history)->entries);
+        array_free(((Game_History*)game->history)->keyframes);
+        array_free(((Game_History*)game->history)->keys);
         free(game->history);
     }
     game->history = calloc(1, sizeof(Game_History));
 
-    ((Game_History*)game->history)->game = array_new(Game);
-    ((Game_History*)game->history)->repetition_index_check = 0;
-    array_push(((Game_History*)game->history)->game, *game);
+    ((Game_History*)game->history)->entries = array_new(Game_History_Entry);
+    ((Game_History*)game->history)->keyframes = array_new(Game*);
+    ((Game_History*)game->history)->keys = array_new(u64);
+    array_push(((Game_History*)game->history)->keys, game->pos.hash);
 }
 
 static bool
@@ -117,238 +268,250 @@ is_black(Chess_Piece piece)
     return !is_white(piece) && piece != CHESS_NONE;
 }
 
-#define BLACK_ATTACK (1 << 0)
-#define WHITE_ATTACK (1 << 1)
+static Chess_Color
+piece_color(Chess_Piece piece)
+{
+    return (piece >= CHESS_BLACK_KING) ? CHESS_COLOR_BLACK : CHESS_COLOR_WHITE;
+}
 
-static s32
-flag_diag_attack(Chess_Piece piece, s32 distance, bool* searching)
+static bool
+inside_board(s32 x, s32 y)
 {
-    s32 result = 0;
-    switch (piece) {
-        case CHESS_WHITE_QUEEN:
-        case CHESS_WHITE_BISHOP: {
-            result |= WHITE_ATTACK;
-            *searching = false;
-        } break;
-        case CHESS_WHITE_KING:
-        case CHESS_WHITE_PAWN: {
-            if (distance == 0) {
-                result |= WHITE_ATTACK;
-            }
-            *searching = false;
-        } break;
-        case CHESS_BLACK_QUEEN:
-        case CHESS_BLACK_BISHOP: {
-            result |= BLACK_ATTACK;
-            *searching = false;
-        } break;
-        case CHESS_BLACK_KING:
-        case CHESS_BLACK_PAWN: {
-            if (distance == 0) {
-                result |= BLACK_ATTACK;
-            }
-            *searching = false;
-        } break;
-        case CHESS_NONE: break;
-        default: {
-            *searching = false;
-        } break;
-    }
+    return (x >= 0 && x < 8) && (y >= 0 && y < 8);
+}
+
+static void
+bitboards_toggle(Chess_Bitboards* bb, Chess_Piece piece, s32 square)
+{
+    u64 bit = 1ULL << square;
+    bb->piece[piece] ^= bit;
+    bb->color[piece_color(piece)] ^= bit;
+}
+
+#define CASTLE_WHITE_SHORT (1 << 0)
+#define CASTLE_WHITE_LONG  (1 << 1)
+#define CASTLE_BLACK_SHORT (1 << 2)
+#define CASTLE_BLACK_LONG  (1 << 3)
+
+static u8
+castle_rights(Position* pos)
+{
+    u8 result = 0;
+    if (pos->white_short_castle_valid) result |= CASTLE_WHITE_SHORT;
+    if (pos->white_long_castle_valid)  result |= CASTLE_WHITE_LONG;
+    if (pos->black_short_castle_valid) result |= CASTLE_BLACK_SHORT;
+    if (pos->black_long_castle_valid)  result |= CASTLE_BLACK_LONG;
     return result;
 }
 
-static s32
-flag_horiz_attack(Chess_Piece piece, s32 distance, bool* searching)
+static void
+set_castle_rights(Position* pos, u8 rights)
 {
-    s32 result = 0;
-    switch(piece) {
-        case CHESS_WHITE_ROOK:
-        case CHESS_WHITE_QUEEN: {
-            result |= WHITE_ATTACK;
-            *searching = false;
-        } break;
-        case CHESS_WHITE_KING: {
-            if (distance == 0) {
-                result |= WHITE_ATTACK;
-            }
-            *searching = false;
-        } break;
-        case CHESS_BLACK_ROOK:
-        case CHESS_BLACK_QUEEN: {
-            result |= BLACK_ATTACK;
-            *searching = false;
-        } break;
-        case CHESS_BLACK_KING: {
-            if (distance == 0) {
-                result |= BLACK_ATTACK;
-            }
-            *searching = false;
-        } break;
-        case CHESS_NONE: break;
-        default: {
-            *searching = false;
-        } break;
+    pos->white_short_castle_valid = (rights & CASTLE_WHITE_SHORT) != 0;
+    pos->white_long_castle_valid  = (rights & CASTLE_WHITE_LONG) != 0;
+    pos->black_short_castle_valid = (rights & CASTLE_BLACK_SHORT) != 0;
+    pos->black_long_castle_valid  = (rights & CASTLE_BLACK_LONG) != 0;
+}
+
+// Every write to the real board goes through here so the bitboards, the king
+// squares, the material signature and the piece part of the hash stay in sync,
+// and the attack maps are rebuilt on next use
+static void
+set_piece(Position* pos, s32 x, s32 y, Chess_Piece piece)
+{
+    Chess_Piece old = pos->board[y][x];
+    if (old != CHESS_NONE) {
+        bitboards_toggle(&pos->bb, old, y * 8 + x);
+        pos->hash ^= zobrist_piece[old][y * 8 + x];
+        pos->material -= material_unit[old][y * 8 + x];
+        pos->psq[EVAL_MIDGAME] -= eval_psq[old][y * 8 + x][EVAL_MIDGAME];
+        pos->psq[EVAL_ENDGAME] -= eval_psq[old][y * 8 + x][EVAL_ENDGAME];
+        if ((old == CHESS_WHITE_KING || old == CHESS_BLACK_KING) && pos->king_square[piece_color(old)] == y * 8 + x)
+            pos->king_square[piece_color(old)] = -1;
     }
-    return result;
+    if (piece != CHESS_NONE) {
+        bitboards_toggle(&pos->bb, piece, y * 8 + x);
+        pos->hash ^= zobrist_piece[piece][y * 8 + x];
+        pos->material += material_unit[piece][y * 8 + x];
+        pos->psq[EVAL_MIDGAME] += eval_psq[piece][y * 8 + x][EVAL_MIDGAME];
+        pos->psq[EVAL_ENDGAME] += eval_psq[piece][y * 8 + x][EVAL_ENDGAME];
+        if (piece == CHESS_WHITE_KING || piece == CHESS_BLACK_KING)
+            pos->king_square[piece_color(piece)] = y * 8 + x;
+    }
+    pos->board[y][x] = piece;
+    pos->attack_map_valid = 0;
 }
 
-static bool
-inside_board(s32 x, s32 y)
+// The en passant file is only part of the key when a pawn of the side to move
+// can capture there, otherwise positions that can't differ would hash apart
+static u64
+en_passant_key(Position* pos)
 {
-    return (x >= 0 && x < 8) && (y >= 0 && y < 8);
+    s32 ep = pos->en_passant_square;
+    if (ep < 0)
+        return 0;
+    Chess_Color us = (pos->white_turn) ? CHESS_COLOR_WHITE : CHESS_COLOR_BLACK;
+    u64 pawns = pos->bb.piece[(us == CHESS_COLOR_WHITE) ? CHESS_WHITE_PAWN : CHESS_BLACK_PAWN];
+    if (!(bb_pawn_attacks[!us][ep] & pawns))
+        return 0;
+    return zobrist_en_passant[ep % 8];
 }
 
-static s32
-square_attacked(Chess_Piece* board, s32 x, s32 y)
+// Rebuilds the bitboards, king squares, material, evaluation sums and hash, and drops the attack maps, after the board or the flags were written
+// directly, must be called after every field of the position is set
+void
+position_sync(Position* pos)
 {
-    s32 result = 0;
+    memset(&pos->bb, 0, sizeof(pos->bb));
+    pos->attack_map_valid = 0;
+    pos->hash = 0;
+    pos->material = 0;
+    pos->psq[EVAL_MIDGAME] = 0;
+    pos->psq[EVAL_ENDGAME] = 0;
+    for (s32 y = 0; y < 8; ++y)
+        for (s32 x = 0; x < 8; ++x)
+        {
+            if (pos->board[y][x] != CHESS_NONE) {
+                bitboards_toggle(&pos->bb, pos->board[y][x], y * 8 + x);
+                pos->hash ^= zobrist_piece[pos->board[y][x]][y * 8 + x];
+                pos->material += material_unit[pos->board[y][x]][y * 8 + x];
+                pos->psq[EVAL_MIDGAME] += eval_psq[pos->board[y][x]][y * 8 + x][EVAL_MIDGAME];
+                pos->psq[EVAL_ENDGAME] += eval_psq[pos->board[y][x]][y * 8 + x][EVAL_ENDGAME];
+            }
+        }
+    pos->hash ^= zobrist_castle[castle_rights(pos)] ^ en_passant_key(pos);
+    if (!pos->white_turn)
+        pos->hash ^= zobrist_black_turn;
 
-    // Check diagonal top left
-    bool searching = true;
-    for (s32 ax = x - 1, ay = y + 1, c = 0; ax >= 0 && ay < 8 && searching; --ax, ++ay, ++c) {
-        result |= flag_diag_attack(board[ay * 8 + ax], c, &searching);
-    }
+    pos->king_square[CHESS_COLOR_WHITE] = (pos->bb.piece[CHESS_WHITE_KING]) ? bb_lsb(pos->bb.piece[CHESS_WHITE_KING]) : -1;
+    pos->king_square[CHESS_COLOR_BLACK] = (pos->bb.piece[CHESS_BLACK_KING]) ? bb_lsb(pos->bb.piece[CHESS_BLACK_KING]) : -1;
+}
 
-    // Check diagonal  right
-    searching = true;
-    for (s32 ax = x + 1, ay = y + 1, c = 0; ax < 8 && ay < 8 && searching; ++ax, ++ay, ++c) {
-        result |= flag_diag_attack(board[ay * 8 + ax], c, &searching);
-    }
+void
+game_sync_bitboards(Game* game)
+{
+    position_sync(&game->pos);
+}
 
-    // Check diagonal bot left
-    searching = true;
-    for (s32 ax = x - 1, ay = y - 1, c = 0; ax >= 0 && ay >= 0 && searching; --ax, --ay, ++c) {
-        result |= flag_diag_attack(board[ay * 8 + ax], c, &searching);
-    }
+// Pieces of both colors attacking square. Sliders look through everything not
+// in occupancy and pieces not in occupancy are left out, so clearing the pieces
+// already traded off uncovers the x-ray attackers behind them.
+static u64
+attackers_to(const Chess_Bitboards* bb, s32 square, u64 occupancy)
+{
+    u64 queens  = bb->piece[CHESS_WHITE_QUEEN] | bb->piece[CHESS_BLACK_QUEEN];
+    u64 rooks   = bb->piece[CHESS_WHITE_ROOK] | bb->piece[CHESS_BLACK_ROOK] | queens;
+    u64 bishops = bb->piece[CHESS_WHITE_BISHOP] | bb->piece[CHESS_BLACK_BISHOP] | queens;
+
+    // Pawns attacking the square sit where a pawn of the other color on it would attack
+    u64 attackers = (bb_pawn_attacks[CHESS_COLOR_BLACK][square] & bb->piece[CHESS_WHITE_PAWN]) |
+        (bb_pawn_attacks[CHESS_COLOR_WHITE][square] & bb->piece[CHESS_BLACK_PAWN]) |
+        (bb_knight_attacks[square] & (bb->piece[CHESS_WHITE_KNIGHT] | bb->piece[CHESS_BLACK_KNIGHT])) |
+        (bb_king_attacks[square] & (bb->piece[CHESS_WHITE_KING] | bb->piece[CHESS_BLACK_KING])) |
+        (bb_bishop_attacks(square, occupancy) & bishops) |
+        (bb_rook_attacks(square, occupancy) & rooks);
+    return attackers & occupancy;
+}
 
-    // Check diagonal bot right
-    searching = true;
-    for (s32 ax = x + 1, ay = y - 1, c = 0; ax < 8 && ay >= 0 && searching; ++ax, --ay, ++c) {
-        result |= flag_diag_attack(board[ay * 8 + ax], c, &searching);
-    }
+u64
+position_attackers_to(Position* pos, s32 square, u64 occupancy)
+{
+    return attackers_to(&pos->bb, square, occupancy);
+}
 
-    // Check horizontal right
-    searching = true;
-    for (s32 ax = x + 1, c = 0; ax < 8 && searching; ++ax, ++c) {
-        result |= flag_horiz_attack(board[y * 8 + ax], c, &searching);
-    }
+static bool
+square_attacked(const Chess_Bitboards* bb, s32 square, Chess_Color by)
+{
+    u64 occupancy = bb->color[CHESS_COLOR_WHITE] | bb->color[CHESS_COLOR_BLACK];
+    return (attackers_to(bb, square, occupancy) & bb->color[by]) != 0;
+}
 
-    // Check horizontal left
-    searching = true;
-    for (s32 ax = x - 1, c = 0; ax >= 0 && searching; --ax, ++c) {
-        result |= flag_horiz_attack(board[y * 8 + ax], c, &searching);
-    }
+// Every square attacked by a color, the occupancy is passed in so the king being
+// evaluated can be removed and can't hide behind itself from a slider
+static u64
+attacked_squares(const Chess_Bitboards* bb, Chess_Color by, u64 occupancy)
+{
+    Chess_Piece base = (by == CHESS_COLOR_WHITE) ? CHESS_WHITE_KING : CHESS_BLACK_KING;
+    u64 result = 0;
+    u64 pieces;
 
-    // Check vertical top
-    searching = true;
-    for (s32 ay = y + 1, c = 0; ay < 8 && searching; ++ay, ++c) {
-        result |= flag_horiz_attack(board[ay * 8 + x], c, &searching);
-    }
+    u64 pawns = bb->piece[base + (CHESS_WHITE_PAWN - CHESS_WHITE_KING)];
+    if (by == CHESS_COLOR_WHITE)
+        result |= ((pawns << 7) & ~BB_FILE_H) | ((pawns << 9) & ~BB_FILE_A);
+    else
+        result |= ((pawns >> 9) & ~BB_FILE_H) | ((pawns >> 7) & ~BB_FILE_A);
 
-    // Check vertical bottom
-    searching = true;
-    for (s32 ay = y - 1, c = 0; ay >= 0 && searching; --ay, ++c) {
-        result |= flag_horiz_attack(board[ay * 8 + x], c, &searching);
-    }
+    pieces = bb->piece[base + (CHESS_WHITE_KNIGHT - CHESS_WHITE_KING)];
+    while (pieces)
+        result |= bb_knight_attacks[bb_pop_lsb(&pieces)];
 
-    // Check knights
-    if (inside_board(x + 1, y + 2) && board[(y + 2) * 8 + x + 1] == CHESS_WHITE_KNIGHT) {
-        result |= WHITE_ATTACK;
-    }
-    if (inside_board(x - 1, y + 2) && board[(y + 2) * 8 + x - 1] == CHESS_WHITE_KNIGHT) {
-        result |= WHITE_ATTACK;
-    }
-    if (inside_board(x + 1, y - 2) && board[(y - 2) * 8 + x + 1] == CHESS_WHITE_KNIGHT) {
-        result |= WHITE_ATTACK;
-    }
-    if (inside_board(x - 1, y - 2) && board[(y - 2) * 8 + x - 1] == CHESS_WHITE_KNIGHT) {
-        result |= WHITE_ATTACK;
-    }
-    if (inside_board(x + 2, y + 1) && board[(y + 1) * 8 + x + 2] == CHESS_WHITE_KNIGHT) {
-        result |= WHITE_ATTACK;
-    }
-    if (inside_board(x - 2, y + 1) && board[(y + 1) * 8 + x - 2] == CHESS_WHITE_KNIGHT) {
-        result |= WHITE_ATTACK;
-    }
-    if (inside_board(x + 2, y - 1) && board[(y - 1) * 8 + x + 2] == CHESS_WHITE_KNIGHT) {
-        result |= WHITE_ATTACK;
-    }
-    if (inside_board(x - 2, y - 1) && board[(y - 1) * 8 + x - 2] == CHESS_WHITE_KNIGHT) {
-        result |= WHITE_ATTACK;
-    }
+    pieces = bb->piece[base + (CHESS_WHITE_BISHOP - CHESS_WHITE_KING)] | bb->piece[base + (CHESS_WHITE_QUEEN - CHESS_WHITE_KING)];
+    while (pieces)
+        result |= bb_bishop_attacks(bb_pop_lsb(&pieces), occupancy);
 
-    if (inside_board(x + 1, y + 2) && board[(y + 2) * 8 + x + 1] == CHESS_BLACK_KNIGHT) {
-        result |= BLACK_ATTACK;
-    }
-    if (inside_board(x - 1, y + 2) && board[(y + 2) * 8 + x - 1] == CHESS_BLACK_KNIGHT) {
-        result |= BLACK_ATTACK;
-    }
-    if (inside_board(x + 1, y - 2) && board[(y - 2) * 8 + x + 1] == CHESS_BLACK_KNIGHT) {
-        result |= BLACK_ATTACK;
-    }
-    if (inside_board(x - 1, y - 2) && board[(y - 2) * 8 + x - 1] == CHESS_BLACK_KNIGHT) {
-        result |= BLACK_ATTACK;
-    }
-    if (inside_board(x + 2, y + 1) && board[(y + 1) * 8 + x + 2] == CHESS_BLACK_KNIGHT) {
-        result |= BLACK_ATTACK;
-    }
-    if (inside_board(x - 2, y + 1) && board[(y + 1) * 8 + x - 2] == CHESS_BLACK_KNIGHT) {
-        result |= BLACK_ATTACK;
-    }
-    if (inside_board(x + 2, y - 1) && board[(y - 1) * 8 + x + 2] == CHESS_BLACK_KNIGHT) {
-        result |= BLACK_ATTACK;
-    }
-    if (inside_board(x - 2, y - 1) && board[(y - 1) * 8 + x - 2] == CHESS_BLACK_KNIGHT) {
-        result |= BLACK_ATTACK;
-    }
+    pieces = bb->piece[base + (CHESS_WHITE_ROOK - CHESS_WHITE_KING)] | bb->piece[base + (CHESS_WHITE_QUEEN - CHESS_WHITE_KING)];
+    while (pieces)
+        result |= bb_rook_attacks(bb_pop_lsb(&pieces), occupancy);
+
+    if (bb->piece[base])
+        result |= bb_king_attacks[bb_lsb(bb->piece[base])];
 
     return result;
 }
 
+// Squares attacked by a color in the current position, computed on first use and
+// kept until a piece moves
+u64
+position_attack_map(Position* pos, Chess_Color by)
+{
+    if (!(pos->attack_map_valid & (1 << by))) {
+        pos->attack_map[by] = attacked_squares(&pos->bb, by, pos->bb.color[CHESS_COLOR_WHITE] | pos->bb.color[CHESS_COLOR_BLACK]);
+        pos->attack_map_valid |= (1 << by);
+    }
+    return pos->attack_map[by];
+}
+
+u64
+game_attack_map(Game* game, Chess_Color by)
+{
+    return position_attack_map(&game->pos, by);
+}
+
+// Uses the attack map when it is already built, a single square probe otherwise
 static bool
-white_in_check(Game* game, bool sim)
+white_in_check(Position* pos)
 {
-    Chess_Piece* board = (sim) ? (Chess_Piece*)game->sim_board : (Chess_Piece*)game->board;
-    for (s32 y = 0; y < 8; ++y)
-        for (s32 x = 0; x < 8; ++x)
-        {
-            if (board[y * 8 + x] == CHESS_WHITE_KING)
-                return square_attacked(board, x, y) & BLACK_ATTACK;
-        }
-    return false;
+    s32 king = pos->king_square[CHESS_COLOR_WHITE];
+    if (king < 0)
+        return false;
+    if (pos->attack_map_valid & (1 << CHESS_COLOR_BLACK))
+        return (pos->attack_map[CHESS_COLOR_BLACK] >> king) & 1;
+    return square_attacked(&pos->bb, king, CHESS_COLOR_BLACK);
 }
 
 static bool
-black_in_check(Game* game, bool sim)
+black_in_check(Position* pos)
 {
-    Chess_Piece* board = (sim) ? (Chess_Piece*)game->sim_board : (Chess_Piece*)game->board;
-    for (s32 y = 0; y < 8; ++y)
-        for (s32 x = 0; x < 8; ++x)
-        {
-            if (board[y * 8 + x] == CHESS_BLACK_KING)
-                return square_attacked(board, x, y) & WHITE_ATTACK;
-        }
-    return false;
+    s32 king = pos->king_square[CHESS_COLOR_BLACK];
+    if (king < 0)
+        return false;
+    if (pos->attack_map_valid & (1 << CHESS_COLOR_WHITE))
+        return (pos->attack_map[CHESS_COLOR_WHITE] >> king) & 1;
+    return square_attacked(&pos->bb, king, CHESS_COLOR_WHITE);
 }
 
 static bool
 white_en_passant(Game* game, s32 from_x, s32 from_y, s32 to_x, s32 to_y)
 {
-    Chess_Piece piece = game->board[from_y][from_x];
-    if (piece == CHESS_WHITE_PAWN && game->last_move.moved_piece == CHESS_BLACK_PAWN && from_y == 4 && game->last_move.from_y == 6 && abs(game->last_move.from_y - game->last_move.to_y) == 2) {
-        return (abs(from_x - game->last_move.from_x) == 1) && (to_x == game->last_move.to_x);
-    }
-    return false;
+    Chess_Piece piece = game->pos.board[from_y][from_x];
+    return piece == CHESS_WHITE_PAWN && to_y * 8 + to_x == game->pos.en_passant_square && to_y - from_y == 1 && abs(to_x - from_x) == 1;
 }
 
 static bool
 black_en_passant(Game* game, s32 from_x, s32 from_y, s32 to_x, s32 to_y)
 {
-    Chess_Piece piece = game->board[from_y][from_x];
-    if (piece == CHESS_BLACK_PAWN && game->last_move.moved_piece == CHESS_WHITE_PAWN && from_y == 3 && game->last_move.from_y == 1 && abs(game->last_move.from_y - game->last_move.to_y) == 2) {
-        return (abs(from_x - game->last_move.from_x) == 1) && (to_x == game->last_move.to_x);
-    }
-    return false;
+    Chess_Piece piece = game->pos.board[from_y][from_x];
+    return piece == CHESS_BLACK_PAWN && to_y * 8 + to_x == game->pos.en_passant_square && from_y - to_y == 1 && abs(to_x - from_x) == 1;
 }
 
 static bool
@@ -357,8 +520,9 @@ is_valid_move(Game* game, s32 from_x, s32 from_y, s32 to_x, s32 to_y, Chess_Piec
     if(!inside_board(from_x, from_y) || !inside_board(to_x, to_y))
         return false;
 
-    Chess_Piece piece = game->board[from_y][from_x];
-    Chess_Piece to_piece = game->board[to_y][to_x];
+    Chess_Piece piece = game->pos.board[from_y][from_x];
+    Chess_Piece to_piece = game->pos.board[to_y][to_x];
+    u64 occupancy = game->pos.bb.color[CHESS_COLOR_WHITE] | game->pos.bb.color[CHESS_COLOR_BLACK];
 
     switch (piece)
     {
@@ -368,7 +532,7 @@ is_valid_move(Game* game, s32 from_x, s32 from_y, s32 to_x, s32 to_y, Chess_Piec
                 return (to_piece == CHESS_NONE); // Can promote too
             } else if (to_y - from_y == 2 && to_x == from_x) {
                 // Move 2 squares forward
-                return (game->board[to_y - 1][to_x] == CHESS_NONE) && (to_piece == CHESS_NONE) && (from_y == 1);
+                return (game->pos.board[to_y - 1][to_x] == CHESS_NONE) && (to_piece == CHESS_NONE) && (from_y == 1);
             } else if (to_y - from_y == 1 && to_x - from_x == 1 || to_y - from_y == 1 && to_x - from_x == -1) {
                 if (to_y == LAST_RANK) {
                     // Promotion with capture
@@ -385,7 +549,7 @@ is_valid_move(Game* game, s32 from_x, s32 from_y, s32 to_x, s32 to_y, Chess_Piec
                 return (to_piece == CHESS_NONE); // Can promote too
             } else if (from_y - to_y == 2 && to_x == from_x) {
                 // Move 2 squares forward
-                return (game->board[to_y + 1][to_x] == CHESS_NONE) && (to_piece == CHESS_NONE) && (from_y == 6);
+                return (game->pos.board[to_y + 1][to_x] == CHESS_NONE) && (to_piece == CHESS_NONE) && (from_y == 6);
             } else if (from_y - to_y == 1 && to_x - from_x == 1 || from_y - to_y == 1 && to_x - from_x == -1) {
                 if (to_y == FIRST_RANK) {
                     // Promotion with capture
@@ -398,16 +562,8 @@ is_valid_move(Game* game, s32 from_x, s32 from_y, s32 to_x, s32 to_y, Chess_Piec
         } break;
         case CHESS_BLACK_BISHOP:
         case CHESS_WHITE_BISHOP: {
-            if (abs(from_x - to_x) != abs(from_y - to_y))
+            if (!(bb_bishop_attacks(from_y * 8 + from_x, occupancy) & BB_SQUARE(to_x, to_y)))
                 return false;
-            s32 ydir = (from_y < to_y) ? 1 : -1;
-            s32 xdir = (from_x < to_x) ? 1 : -1;
-            s32 count = abs(from_y - to_y) - 1;
-            for (s32 y = from_y + ydir, x = from_x + xdir, c = 0; c < count; y += ydir, x += xdir, ++c)
-            {
-                if (game->board[y][x] != CHESS_NONE)
-                    return false;
-            }
             if(piece == CHESS_BLACK_BISHOP)
                 return (is_white(to_piece) || to_piece == CHESS_NONE);
             else
@@ -438,115 +594,61 @@ is_valid_move(Game* game, s32 from_x, s32 from_y, s32 to_x, s32 to_y, Chess_Piec
         } break;
         case CHESS_WHITE_ROOK:
         case CHESS_BLACK_ROOK: {
-            if (from_x == to_x && from_y != to_y) {
-                s32 ydir = (from_y < to_y) ? 1 : -1;
-                s32 count = abs(from_y - to_y) - 1;
-                for (s32 y = from_y + ydir, c = 0; c < count; y += ydir, ++c)
-                {
-                    if (game->board[y][from_x] != CHESS_NONE)
-                        return false;
-                }
-            } else if(from_y == to_y && from_x != to_x) {
-                s32 xdir = (from_x < to_x) ? 1 : -1;
-                s32 count = abs(from_x - to_x) - 1;
-                for (s32 x = from_x + xdir, c = 0; c < count; x += xdir, ++c)
-                {
-                    if (game->board[from_y][x] != CHESS_NONE)
-                        return false;
-                }
-            } else {
+            if (!(bb_rook_attacks(from_y * 8 + from_x, occupancy) & BB_SQUARE(to_x, to_y)))
                 return false;
-            }
             if (piece == CHESS_BLACK_ROOK)
                 return (is_white(to_piece) || to_piece == CHESS_NONE);
             else
                 return (is_black(to_piece) || to_piece == CHESS_NONE);
         } break;
         case CHESS_WHITE_KING: {
-            if (abs(from_y - to_y) == 1 && abs(from_x - to_x) == 1) {
+            if (bb_king_attacks[from_y * 8 + from_x] & BB_SQUARE(to_x, to_y)) {
                 // Normal move
                 return (is_black(to_piece) || to_piece == CHESS_NONE);
-            } else if (from_x == 4 && to_x == 2) {
+            } else if (from_x == 4 && from_y == 0 && to_y == from_y && to_x == 2) {
                 // Castle long
-                if (!game->white_long_castle_valid)
+                if (!game->pos.white_long_castle_valid || game->pos.board[from_y][0] != CHESS_WHITE_ROOK)
                     return false;
-                if(!(game->board[from_y][from_x-1] == CHESS_NONE && game->board[from_y][from_x - 2] == CHESS_NONE))
+                if(!(game->pos.board[from_y][from_x - 1] == CHESS_NONE && game->pos.board[from_y][from_x - 2] == CHESS_NONE && game->pos.board[from_y][from_x - 3] == CHESS_NONE))
                     return false;
 
-                return !((square_attacked((Chess_Piece*)game->board, from_x - 1, from_y) & BLACK_ATTACK) || (square_attacked((Chess_Piece*)game->board, from_x - 2, from_y) & BLACK_ATTACK));
-            } else if (from_x == 4 && to_x == 6) {
-                // Casle short
-                if (!game->white_short_castle_valid)
+                return !(position_attack_map(&game->pos, CHESS_COLOR_BLACK) & (BB_SQUARE(from_x - 1, from_y) | BB_SQUARE(from_x - 2, from_y)));
+            } else if (from_x == 4 && from_y == 0 && to_y == from_y && to_x == 6) {
+                // Castle short
+                if (!game->pos.white_short_castle_valid || game->pos.board[from_y][7] != CHESS_WHITE_ROOK)
                     return false;
-                if(!(game->board[from_y][from_x + 1] == CHESS_NONE && game->board[from_y][from_x + 2] == CHESS_NONE))
+                if(!(game->pos.board[from_y][from_x + 1] == CHESS_NONE && game->pos.board[from_y][from_x + 2] == CHESS_NONE))
                     return false;
 
-                return !((square_attacked((Chess_Piece*)game->board, from_x + 1, from_y) & BLACK_ATTACK) || (square_attacked((Chess_Piece*)game->board, from_x + 2, from_y) & BLACK_ATTACK));
+                return !(position_attack_map(&game->pos, CHESS_COLOR_BLACK) & (BB_SQUARE(from_x + 1, from_y) | BB_SQUARE(from_x + 2, from_y)));
             }
         } break;
         case CHESS_BLACK_KING: {
-            if (abs(from_y - to_y) == 1 && abs(from_x - to_x) == 1) {
+            if (bb_king_attacks[from_y * 8 + from_x] & BB_SQUARE(to_x, to_y)) {
                 // Normal move
                 return (is_white(to_piece) || to_piece == CHESS_NONE);
-            } else if (from_x == 4 && to_x == 2) {
+            } else if (from_x == 4 && from_y == 7 && to_y == from_y && to_x == 2) {
                 // Castle long
-                if (!game->black_long_castle_valid)
+                if (!game->pos.black_long_castle_valid || game->pos.board[from_y][0] != CHESS_BLACK_ROOK)
                     return false;
-                if(!(game->board[from_y][from_x - 1] == CHESS_NONE && game->board[from_y][from_x - 2] == CHESS_NONE))
+                if(!(game->pos.board[from_y][from_x - 1] == CHESS_NONE && game->pos.board[from_y][from_x - 2] == CHESS_NONE && game->pos.board[from_y][from_x - 3] == CHESS_NONE))
                     return false;
-                // TODO(psv): check if the squares are attacked
-                return !((square_attacked((Chess_Piece*)game->board, from_x - 1, from_y) & WHITE_ATTACK) || (square_attacked((Chess_Piece*)game->board, from_x - 2, from_y) & WHITE_ATTACK));
-            } else if (from_x == 4 && to_x == 6) {
-                // Casle short
-                if (!game->black_short_castle_valid)
+
+                return !(position_attack_map(&game->pos, CHESS_COLOR_WHITE) & (BB_SQUARE(from_x - 1, from_y) | BB_SQUARE(from_x - 2, from_y)));
+            } else if (from_x == 4 && from_y == 7 && to_y == from_y && to_x == 6) {
+                // Castle short
+                if (!game->pos.black_short_castle_valid || game->pos.board[from_y][7] != CHESS_BLACK_ROOK)
                     return false;
-                if(!(game->board[from_y][from_x + 1] == CHESS_NONE && game->board[from_y][from_x + 2] == CHESS_NONE))
+                if(!(game->pos.board[from_y][from_x + 1] == CHESS_NONE && game->pos.board[from_y][from_x + 2] == CHESS_NONE))
                     return false;
-                
-                return !((square_attacked((Chess_Piece*)game->board, from_x + 1, from_y) & WHITE_ATTACK) || (square_attacked((Chess_Piece*)game->board, from_x + 2, from_y) & WHITE_ATTACK));
+
+                return !(position_attack_map(&game->pos, CHESS_COLOR_WHITE) & (BB_SQUARE(from_x + 1, from_y) | BB_SQUARE(from_x + 2, from_y)));
             }
         } break;
         case CHESS_BLACK_QUEEN:
         case CHESS_WHITE_QUEEN: {
-            bool valid_bishop = true;
-            bool valid_rook = true;
-
-            // Bishop check
-            if (abs(from_x - to_x) != abs(from_y - to_y))
-                valid_bishop = false;
-            s32 ydir = (from_y < to_y) ? 1 : -1;
-            s32 xdir = (from_x < to_x) ? 1 : -1;
-            s32 count = abs(from_y - to_y) - 1;
-            for (s32 y = from_y + ydir, x = from_x + xdir, c = 0; c < count; y += ydir, x += xdir, ++c)
-            {
-                if (game->board[y][x] != CHESS_NONE)
-                    valid_bishop = false;
-            }
-
-            // Rook check
-            if (from_x == to_x && from_y != to_y) {
-                s32 ydir = (from_y < to_y) ? 1 : -1;
-                s32 count = abs(from_y - to_y) - 1;
-                for (s32 y = from_y + ydir, c = 0; c < count; y += ydir, ++c)
-                {
-                    if (game->board[y][from_x] != CHESS_NONE)
-                        valid_rook = false;
-                }
-            } else if(from_y == to_y && from_x != to_x) {
-                s32 xdir = (from_x < to_x) ? 1 : -1;
-                s32 count = abs(from_x - to_x) - 1;
-                for (s32 x = from_x + xdir, c = 0; c < count; x += xdir, ++c)
-                {
-                    if (game->board[from_y][x] != CHESS_NONE)
-                        valid_rook = false;
-                }
-            } else {
-                valid_rook = false;
-            }
-
-            if (!valid_bishop && !valid_rook)
+            if (!(bb_queen_attacks(from_y * 8 + from_x, occupancy) & BB_SQUARE(to_x, to_y)))
                 return false;
-            
             if (piece == CHESS_BLACK_QUEEN)
                 return (is_white(to_piece) || to_piece == CHESS_NONE);
             else
@@ -557,14 +659,211 @@ is_valid_move(Game* game, s32 from_x, s32 from_y, s32 to_x, s32 to_y, Chess_Piec
     return false;
 }
 
+// Rights lost when a piece leaves or lands on the square, covers king moves,
+// rook moves and rooks captured in their corner
+static u8
+castle_rights_lost(s32 x, s32 y)
+{
+    if (y == 0 && x == 4) return CASTLE_WHITE_SHORT | CASTLE_WHITE_LONG;
+    if (y == 0 && x == 7) return CASTLE_WHITE_SHORT;
+    if (y == 0 && x == 0) return CASTLE_WHITE_LONG;
+    if (y == 7 && x == 4) return CASTLE_BLACK_SHORT | CASTLE_BLACK_LONG;
+    if (y == 7 && x == 7) return CASTLE_BLACK_SHORT;
+    if (y == 7 && x == 0) return CASTLE_BLACK_LONG;
+    return 0;
+}
+
+// Piece offsets from the king of the same color, indexed by Chess_Promotion
+static const s32 promotion_offset[4] = {
+    CHESS_WHITE_KNIGHT - CHESS_WHITE_KING,
+    CHESS_WHITE_BISHOP - CHESS_WHITE_KING,
+    CHESS_WHITE_ROOK - CHESS_WHITE_KING,
+    CHESS_WHITE_QUEEN - CHESS_WHITE_KING,
+};
+
+static Chess_Piece
+promotion_piece(Chess_Color color, s32 promotion)
+{
+    Chess_Piece king = (color == CHESS_COLOR_WHITE) ? CHESS_WHITE_KING : CHESS_BLACK_KING;
+    return king + promotion_offset[promotion];
+}
+
+// The flag depends on the position, a pawn moving diagonally to the en passant
+// square or a king moving two files
+Chess_Packed_Move
+chess_move_pack(Game* game, Chess_Move move)
+{
+    s32 from = move.from_y * 8 + move.from_x;
+    s32 to = move.to_y * 8 + move.to_x;
+    Chess_Piece piece = game->pos.board[move.from_y][move.from_x];
+    bool pawn = (piece == CHESS_WHITE_PAWN || piece == CHESS_BLACK_PAWN);
+    bool king = (piece == CHESS_WHITE_KING || piece == CHESS_BLACK_KING);
+
+    if (pawn && move.promotion_piece != CHESS_NONE && (move.to_y == LAST_RANK || move.to_y == FIRST_RANK)) {
+        s32 offset = move.promotion_piece - ((piece_color(move.promotion_piece) == CHESS_COLOR_WHITE) ? CHESS_WHITE_KING : CHESS_BLACK_KING);
+        for (s32 i = 0; i < 4; ++i)
+            if (promotion_offset[i] == offset)
+                return CHESS_PACK_MOVE(from, to, i, CHESS_MOVE_PROMOTION);
+    }
+    if (pawn && to == game->pos.en_passant_square && move.from_x != move.to_x)
+        return CHESS_PACK_MOVE(from, to, 0, CHESS_MOVE_EN_PASSANT);
+    if (king && abs(move.from_x - move.to_x) == 2)
+        return CHESS_PACK_MOVE(from, to, 0, CHESS_MOVE_CASTLE);
+    return CHESS_PACK_MOVE(from, to, 0, CHESS_MOVE_NORMAL);
+}
+
+// Expands a move that is about to be played, the moved piece is read from the board
+Chess_Move
+chess_move_unpack(Game* game, Chess_Packed_Move move)
+{
+    Chess_Move result = {0};
+    s32 from = CHESS_MOVE_FROM(move);
+    s32 to = CHESS_MOVE_TO(move);
+    result.from_x = from % 8;
+    result.from_y = from / 8;
+    result.to_x = to % 8;
+    result.to_y = to / 8;
+    result.moved_piece = game->pos.board[result.from_y][result.from_x];
+    if (CHESS_MOVE_FLAG(move) == CHESS_MOVE_PROMOTION)
+        result.promotion_piece = promotion_piece(piece_color(result.moved_piece), CHESS_MOVE_PROMOTION(move));
+    return result;
+}
+
+// Applies a move in place without validating it, the state needed to take it back
+// is saved in undo. The move must be at least pseudo legal for the current position.
+void
+position_make_move(Position* pos, Chess_Packed_Move move, Chess_Undo* undo)
+{
+    s32 from = CHESS_MOVE_FROM(move), to = CHESS_MOVE_TO(move);
+    s32 from_x = from % 8, from_y = from / 8;
+    s32 to_x = to % 8, to_y = to / 8;
+    s32 flag = CHESS_MOVE_FLAG(move);
+    Chess_Piece piece = pos->board[from_y][from_x];
+    bool pawn = (piece == CHESS_WHITE_PAWN || piece == CHESS_BLACK_PAWN);
+
+    undo->captured = pos->board[to_y][to_x];
+    undo->castle_rights = castle_rights(pos);
+    undo->en_passant_square = pos->en_passant_square;
+    undo->move_draw_count = pos->move_draw_count;
+    pos->hash ^= zobrist_castle[undo->castle_rights] ^ en_passant_key(pos);
+
+    if (flag == CHESS_MOVE_EN_PASSANT) {
+        // The captured pawn is beside the moving one, not on the target square
+        undo->captured = pos->board[from_y][to_x];
+        set_piece(pos, to_x, from_y, CHESS_NONE);
+    }
+
+    Chess_Piece new_piece = (flag == CHESS_MOVE_PROMOTION) ? promotion_piece(piece_color(piece), CHESS_MOVE_PROMOTION(move)) : piece;
+    set_piece(pos, from_x, from_y, CHESS_NONE);
+    set_piece(pos, to_x, to_y, new_piece);
+
+    if (flag == CHESS_MOVE_CASTLE) {
+        if (to_x < from_x) {
+            // Castle long
+            set_piece(pos, to_x + 1, to_y, pos->board[to_y][0]);
+            set_piece(pos, 0, to_y, CHESS_NONE);
+        } else {
+            // Castle short
+            set_piece(pos, to_x - 1, to_y, pos->board[to_y][7]);
+            set_piece(pos, 7, to_y, CHESS_NONE);
+        }
+    }
+
+    set_castle_rights(pos, undo->castle_rights & ~(castle_rights_lost(from_x, from_y) | castle_rights_lost(to_x, to_y)));
+
+    if (pawn && abs(from_y - to_y) == 2)
+        pos->en_passant_square = ((from_y + to_y) / 2) * 8 + from_x;
+    else
+        pos->en_passant_square = -1;
+
+    if (pawn || undo->captured != CHESS_NONE)
+        pos->move_draw_count = 0;
+    else
+        pos->move_draw_count++;
+
+    pos->white_turn = !pos->white_turn;
+    pos->hash ^= zobrist_castle[castle_rights(pos)] ^ en_passant_key(pos) ^ zobrist_black_turn;
+}
+
+void
+position_unmake_move(Position* pos, Chess_Packed_Move move, const Chess_Undo* undo)
+{
+    s32 from = CHESS_MOVE_FROM(move), to = CHESS_MOVE_TO(move);
+    s32 from_x = from % 8, from_y = from / 8;
+    s32 to_x = to % 8, to_y = to / 8;
+    s32 flag = CHESS_MOVE_FLAG(move);
+
+    pos->hash ^= zobrist_castle[castle_rights(pos)] ^ en_passant_key(pos) ^ zobrist_black_turn;
+    pos->white_turn = !pos->white_turn;
+    pos->move_draw_count = undo->move_draw_count;
+    pos->en_passant_square = undo->en_passant_square;
+    set_castle_rights(pos, undo->castle_rights);
+
+    Chess_Piece piece = pos->board[to_y][to_x];
+    if (flag == CHESS_MOVE_PROMOTION)
+        piece = (pos->white_turn) ? CHESS_WHITE_PAWN : CHESS_BLACK_PAWN;
+
+    if (flag == CHESS_MOVE_CASTLE) {
+        if (to_x < from_x) {
+            set_piece(pos, 0, to_y, pos->board[to_y][to_x + 1]);
+            set_piece(pos, to_x + 1, to_y, CHESS_NONE);
+        } else {
+            set_piece(pos, 7, to_y, pos->board[to_y][to_x - 1]);
+            set_piece(pos, to_x - 1, to_y, CHESS_NONE);
+        }
+    }
+
+    set_piece(pos, from_x, from_y, piece);
+    if (flag == CHESS_MOVE_EN_PASSANT) {
+        set_piece(pos, to_x, to_y, CHESS_NONE);
+        set_piece(pos, to_x, from_y, (Chess_Piece)undo->captured);
+    } else {
+        set_piece(pos, to_x, to_y, (Chess_Piece)undo->captured);
+    }
+    pos->hash ^= zobrist_castle[undo->castle_rights] ^ en_passant_key(pos);
+}
+
+void
+game_make_move(Game* game, Chess_Packed_Move move, Chess_Undo* undo)
+{
+    position_make_move(&game->pos, move, undo);
+}
+
+void
+game_unmake_move(Game* game, Chess_Packed_Move move, const Chess_Undo* undo)
+{
+    position_unmake_move(&game->pos, move, undo);
+}
+
+static void
+history_push_move(Game* game, Chess_Packed_Move move, const Chess_Undo* undo, r64 mover_time_ms)
+{
+    Game_History* history = ((Game_History*)game->history);
+    Game_History_Entry entry = {0};
+    entry.move = move;
+    entry.undo = *undo;
+    entry.mover_time_ms = mover_time_ms;
+    array_push(history->entries, entry);
+    array_push(history->keys, game->pos.hash);
+}
+
+// Expands a move that was already played, the piece is now on the target square
+static Chess_Move
+played_move(Game* game, Chess_Packed_Move move)
+{
+    Chess_Move result = chess_move_unpack(game, move);
+    result.moved_piece = game->pos.board[result.to_y][result.to_x];
+    if (CHESS_MOVE_FLAG(move) == CHESS_MOVE_PROMOTION) {
+        result.promotion_piece = result.moved_piece;
+        result.moved_piece = (piece_color(result.promotion_piece) == CHESS_COLOR_WHITE) ? CHESS_WHITE_PAWN : CHESS_BLACK_PAWN;
+    }
+    return result;
+}
+
 bool
 game_move(Game* game, s32 from_x, s32 from_y, s32 to_x, s32 to_y, Chess_Piece promotion_choice, bool simulate, bool* capt)
 {
-    // Copy the state so we can simulate
-    memcpy(game->sim_board, game->board, sizeof(game->board));
-
-    Chess_Piece from_piece = game->board[from_y][from_x];
-    Chess_Piece to_piece = game->board[to_y][to_x];
+    Chess_Piece from_piece = game->pos.board[from_y][from_x];
 
     if (from_piece == CHESS_NONE) {
         return false;
@@ -588,158 +887,83 @@ game_move(Game* game, s32 from_x, s32 from_y, s32 to_x, s32 to_y, Chess_Piece pr
     }
 
     // Check if who is moving is in fact who's turn it is
-    if(!(game->white_turn && is_white(from_piece) || !game->white_turn && is_black(from_piece)))
+    if(!(game->pos.white_turn && is_white(from_piece) || !game->pos.white_turn && is_black(from_piece)))
         return false; // Invalid move, not the pieces turn
 
     bool valid = is_valid_move(game, from_x, from_y, to_x, to_y, promotion_choice);
     if (!valid) return false;
 
     // Check castle while in check
-    if (from_piece == CHESS_WHITE_KING && abs(from_x - to_x) == 2 && white_in_check(game, false))
+    if (from_piece == CHESS_WHITE_KING && abs(from_x - to_x) == 2 && white_in_check(&game->pos))
         return false;
-    if (from_piece == CHESS_BLACK_KING && abs(from_x - to_x) == 2 && black_in_check(game, false))
+    if (from_piece == CHESS_BLACK_KING && abs(from_x - to_x) == 2 && black_in_check(&game->pos))
         return false;
 
-    // Simulate the move
-    game->sim_board[to_y][to_x] = new_piece;
-    game->sim_board[from_y][from_x] = CHESS_NONE;
-
-    // Do all the checks in the simulation
-    if (game->white_turn && white_in_check(game, true))
-        return false;
-    if (!game->white_turn && black_in_check(game, true))
-        return false;
-
-    if(!simulate) 
-    {
-        bool captured = false;
-
-        // After all checks, perform the move
-        if (game->white_turn && white_en_passant(game, from_x, from_y, to_x, to_y)){
-            game->board[to_y - 1][to_x] = CHESS_NONE;
-            captured = true;
-        }
-        if (!game->white_turn && black_en_passant(game, from_x, from_y, to_x, to_y)) {
-            game->board[to_y + 1][to_x] = CHESS_NONE;
-            captured = true;
-        }
-
-        if(game->board[to_y][to_x] != CHESS_NONE)
-            captured = true;
-
-        game->board[to_y][to_x] = new_piece;
-        game->board[from_y][from_x] = CHESS_NONE;
-
-        // Saves the last move to check en passant
-        game->last_move.start = false;
-        game->last_move.promotion_piece = promotion_choice;
-        game->last_move.from_x = from_x;
-        game->last_move.from_y = from_y;
-        game->last_move.to_x = to_x;
-        game->last_move.to_y = to_y;
-        game->last_move.moved_piece = from_piece;
-
-        if(from_piece == CHESS_WHITE_KING) {
-            if(from_x - to_x == 2) {
-                // Castle long
-                game->board[to_y][to_x + 1] = CHESS_WHITE_ROOK;
-                game->board[to_y][0] = CHESS_NONE;
-            } else if (from_x - to_x == -2) {
-                // Castle short
-                game->board[to_y][to_x - 1] = CHESS_WHITE_ROOK;
-                game->board[to_y][7] = CHESS_NONE;
-            }
-            game->white_long_castle_valid = false;
-            game->white_short_castle_valid = false;
-        }
-        if(from_piece == CHESS_BLACK_KING) {
-            if(from_x - to_x == 2) {
-                // Castle long
-                game->board[to_y][to_x + 1] = CHESS_BLACK_ROOK;
-                game->board[to_y][0] = CHESS_NONE;
-            } else if (from_x - to_x == -2) {
-                // Castle short
-                game->board[to_y][to_x - 1] = CHESS_BLACK_ROOK;
-                game->board[to_y][7] = CHESS_NONE;
-            }
-            game->black_long_castle_valid = false;
-            game->black_short_castle_valid = false;
-        }
-        if (from_piece == CHESS_WHITE_ROOK) {
-            if (game->white_short_castle_valid && from_x == 7 && from_y == 0)
-                game->white_short_castle_valid = false;
-            if (game->white_long_castle_valid && from_x == 0 && from_y == 0)
-                game->white_long_castle_valid = false;
-        }
-        if (from_piece == CHESS_BLACK_ROOK) {
-            if (game->black_short_castle_valid && from_x == 7 && from_y == 7)
-                game->black_short_castle_valid = false;
-            if (game->black_long_castle_valid && from_x == 0 && from_y == 7)
-                game->black_long_castle_valid = false;
-        }
-
-        if(from_piece == CHESS_WHITE_PAWN || from_piece == CHESS_BLACK_PAWN || captured)
-            game->move_draw_count = 0;
-        else
-            game->move_draw_count++;
-        if(capt) *capt = captured;
-
-        if(game->white_turn)
-            game->white_time_ms += game->increment_ms;
-        else
-            game->black_time_ms += game->increment_ms;
-
-        game->move_count++;
-
-        // Pass the turn
-        game->white_turn = !game->white_turn;
-
-        Gen_Moves moves = {0};
-        s32 count_moves = generate_possible_moves(game, &moves);
-        s32 mv_count = 0;
-        for(int i = 0; i < array_length(moves.move); ++i) {
-            if(game_move(game, moves.move[i].from_x, moves.move[i].from_y, moves.move[i].to_x, moves.move[i].to_y, moves.move[i].promotion_piece, true, 0)) {
-                mv_count++;
-            }
-        }
-        array_free(moves.move);
+    Chess_Move move = {0};
+    move.from_x = from_x;
+    move.from_y = from_y;
+    move.to_x = to_x;
+    move.to_y = to_y;
+    move.promotion_piece = (new_piece != from_piece) ? new_piece : CHESS_NONE;
+    move.moved_piece = from_piece;
+    Chess_Packed_Move packed = chess_move_pack(game, move);
+
+    // Play the move in place and take it back if it leaves the king in check
+    Chess_Undo undo;
+    game_make_move(game, packed, &undo);
+    bool in_check = (game->pos.white_turn) ? black_in_check(&game->pos) : white_in_check(&game->pos);
+    if (in_check || simulate) {
+        game_unmake_move(game, packed, &undo);
+        return !in_check;
+    }
 
-        if(mv_count == 0) {
-            if(!game->white_turn) {
-                if(black_in_check(game, false)) {
-                    printf("Checkmate, white wins by checkmate\n");
-                    game->winner = PLAYER_WHITE;
-                } else {
-                    printf("Draw by stalemate\n");
-                    game->winner = PLAYER_DRAW_STALEMATE;
-                }
-            }
-            else {
-                if(white_in_check(game, false)) {
-                    printf("Checkmate, black wins by checkmate\n");
-                    game->winner = PLAYER_BLACK;
-                } else {
-                    printf("Draw by stalemate\n");
-                    game->winner = PLAYER_DRAW_STALEMATE;
-                }
-            }
-        } else if(game->move_draw_count == 50 * 2) {
-            printf("Draw by 50 move rule\n");
-            game->winner = PLAYER_DRAW_50_MOVE;
-        } else if(!check_sufficient_material(game)) {
-            printf("Draw by insufficient material\n");
-            game->winner = PLAYER_DRAW_INSUFFICIENT_MATERIAL;
+    bool captured = (undo.captured != CHESS_NONE);
+
+    // Saves the last move to be displayed
+    game->last_move.start = false;
+    game->last_move.promotion_piece = promotion_choice;
+    game->last_move.from_x = from_x;
+    game->last_move.from_y = from_y;
+    game->last_move.to_x = to_x;
+    game->last_move.to_y = to_y;
+    game->last_move.moved_piece = from_piece;
+
+    if(capt) *capt = captured;
+
+    // The turn was already passed by position_make_move
+    r64 mover_time_ms = (!game->pos.white_turn) ? game->white_time_ms : game->black_time_ms;
+    if(!game->pos.white_turn)
+        game->white_time_ms += game->increment_ms;
+    else
+        game->black_time_ms += game->increment_ms;
+
+    game->move_count++;
+
+    Chess_Status status = game_status(game);
+    if(status == CHESS_STATUS_CHECKMATE) {
+        if(!game->pos.white_turn) {
+            printf("Checkmate, white wins by checkmate\n");
+            game->winner = PLAYER_WHITE;
+        } else {
+            printf("Checkmate, black wins by checkmate\n");
+            game->winner = PLAYER_BLACK;
         }
+    } else if(status == CHESS_STATUS_STALEMATE) {
+        printf("Draw by stalemate\n");
+        game->winner = PLAYER_DRAW_STALEMATE;
+    } else if(game->pos.move_draw_count == 50 * 2) {
+        printf("Draw by 50 move rule\n");
+        game->winner = PLAYER_DRAW_50_MOVE;
+    } else if(!check_sufficient_material(game)) {
+        printf("Draw by insufficient material\n");
+        game->winner = PLAYER_DRAW_INSUFFICIENT_MATERIAL;
+    }
 
-        // Save history
-        array_push(((Game_History*)game->history)->game, *game);
-        if(game->move_draw_count == 0)
-            ((Game_History*)game->history)->repetition_index_check = array_length(((Game_History*)game->history)->game) - 1;
+    history_push_move(game, packed, &undo, mover_time_ms);
 
-        if(check_repetition(game)) {
-            printf("Draw by repetition\n");
-            game->winner = PLAYER_DRAW_THREE_FOLD_REPETITION;
-        }
+    if(check_repetition(game)) {
+        printf("Draw by repetition\n");
+        game->winner = PLAYER_DRAW_THREE_FOLD_REPETITION;
     }
 
     return true;
@@ -751,472 +975,386 @@ game_move_apply(Game* game, Chess_Move move, bool simulate, bool* capt)
     return game_move(game, move.from_x, move.from_y, move.to_x, move.to_y, move.promotion_piece, simulate, capt);
 }
 
-static void 
-generate_pawn_moves(Game* game, s32 x, s32 y, Gen_Moves* moves) 
-{
-	Chess_Move mv = {0};
-	mv.from_y = y;
-	mv.from_x = x;
-
-	s8 move_direction = 1;
-	s8 black_piece_flag = 0;
-	s8 seventh_rank = 6;
-	if (!game->white_turn) {
-		move_direction = -1;
-		black_piece_flag = 8;
-		seventh_rank = 2;
-	}
-
-	// advance once
-	{
-		mv.to_y = y + move_direction;
-		mv.to_x = x;
-
-		// advance once promote
-		if (y == seventh_rank) {
-			mv.promotion_piece = (move_direction == 1) ? CHESS_WHITE_QUEEN : CHESS_BLACK_QUEEN;
-            if(is_valid_move(game, mv.from_x, mv.from_y, mv.to_x, mv.to_y, mv.promotion_piece))
-            {
-                array_push(moves->move, mv);
-                mv.promotion_piece = (move_direction == 1) ? CHESS_WHITE_ROOK : CHESS_BLACK_ROOK;
-                array_push(moves->move, mv);
-                mv.promotion_piece = (move_direction == 1) ? CHESS_WHITE_BISHOP : CHESS_BLACK_BISHOP;
-                array_push(moves->move, mv);
-                mv.promotion_piece = (move_direction == 1) ? CHESS_WHITE_KNIGHT : CHESS_BLACK_KNIGHT;
-                array_push(moves->move, mv);
-            }
-		} else {
-			if(is_valid_move(game, mv.from_x, mv.from_y, mv.to_x, mv.to_y, mv.promotion_piece))
-                array_push(moves->move, mv);
-		}
-	}
-
-	// advance twice
-	{
-    mv.promotion_piece = CHESS_NONE;
-		mv.to_x = x;
-		mv.to_y = y + 2 * move_direction;
-		if(is_valid_move(game, mv.from_x, mv.from_y, mv.to_x, mv.to_y, mv.promotion_piece))
-			array_push(moves->move, mv);
-	}
 
-	// capture normal - en passant
-	{
-		mv.to_y = y + move_direction;
-		if (y == seventh_rank) {
-			// capture promote
-			mv.to_x = x + 1;
-			mv.promotion_piece = (move_direction == 1) ? CHESS_WHITE_KNIGHT : CHESS_BLACK_KNIGHT;
-			if(is_valid_move(game, mv.from_x, mv.from_y, mv.to_x, mv.to_y, mv.promotion_piece)) {
-				array_push(moves->move, mv);
-                mv.promotion_piece = (move_direction == 1) ? CHESS_WHITE_ROOK : CHESS_BLACK_ROOK;
-                array_push(moves->move, mv);
-                mv.promotion_piece = (move_direction == 1) ? CHESS_WHITE_BISHOP : CHESS_BLACK_BISHOP;
-                array_push(moves->move, mv);
-                mv.promotion_piece = (move_direction == 1) ? CHESS_WHITE_KNIGHT : CHESS_BLACK_KNIGHT;
-                array_push(moves->move, mv);
-			}
-
-            mv.to_x = x - 1;
-			mv.promotion_piece = (move_direction == 1) ? CHESS_WHITE_KNIGHT : CHESS_BLACK_KNIGHT;
-			if(is_valid_move(game, mv.from_x, mv.from_y, mv.to_x, mv.to_y, mv.promotion_piece)) {
-				array_push(moves->move, mv);
-                mv.promotion_piece = (move_direction == 1) ? CHESS_WHITE_ROOK : CHESS_BLACK_ROOK;
-                array_push(moves->move, mv);
-                mv.promotion_piece = (move_direction == 1) ? CHESS_WHITE_BISHOP : CHESS_BLACK_BISHOP;
-                array_push(moves->move, mv);
-                mv.promotion_piece = (move_direction == 1) ? CHESS_WHITE_KNIGHT : CHESS_BLACK_KNIGHT;
-                array_push(moves->move, mv);
-			}
-		} else {
-			mv.promotion_piece = CHESS_NONE;
-
-			mv.to_x = x + 1;
-            if(is_valid_move(game, mv.from_x, mv.from_y, mv.to_x, mv.to_y, mv.promotion_piece)) {
-                array_push(moves->move, mv);
-            }
-
-			mv.to_x = x - 1;
-            if(is_valid_move(game, mv.from_x, mv.from_y, mv.to_x, mv.to_y, mv.promotion_piece)) {
-                array_push(moves->move, mv);
-            }
-		}
-	}
+static void
+push_move(Gen_Moves* moves, s32 from, s32 to, s32 promotion, s32 flag)
+{
+	moves->move[moves->count++] = CHESS_PACK_MOVE(from, to, promotion, flag);
 }
 
-static void 
-generate_bishop_moves(Game* game, s32 x, s32 y, Gen_Moves* moves) 
-{
-	Chess_Move mv = {0};
-	mv.from_x = x;
-	mv.from_y = y;
-
-	// top left
-	for (s32 i = y + 1, j = x -1 ; i < 8 && j >= 0; ++i, --j) {
-		mv.to_x = j;
-		mv.to_y = i;
-		if(is_valid_move(game, mv.from_x, mv.from_y, mv.to_x, mv.to_y, mv.promotion_piece)) {
-			array_push(moves->move, mv);
-		} else
-			break;
-	}
-
-	// top right
-	for (s32 i = y + 1, j = x + 1; i < 8 && j < 8; ++i, ++j) {
-		mv.to_x = j;
-		mv.to_y = i;
-		if(is_valid_move(game, mv.from_x, mv.from_y, mv.to_x, mv.to_y, mv.promotion_piece)) {
-			array_push(moves->move, mv);
-		} else
-			break;
-	}
-
-	// bot left
-	for (s32 i = y - 1, j = x - 1; i >= 0 && j >= 0; --i, --j) {
-		mv.to_x = j;
-		mv.to_y = i;
-		if(is_valid_move(game, mv.from_x, mv.from_y, mv.to_x, mv.to_y, mv.promotion_piece)) {
-			array_push(moves->move, mv);
-		}
-		else
-			break;
-	}
-
-	// bot right
-	for (s32 i = y - 1, j = x + 1; i >= 0, j < 8; --i, ++j) {
-		mv.to_x = j;
-		mv.to_y = i;
-		if(is_valid_move(game, mv.from_x, mv.from_y, mv.to_x, mv.to_y, mv.promotion_piece))  {
-			array_push(moves->move, mv);
-		} else
-			break;
-	}
+static void
+push_targets(Gen_Moves* moves, s32 from, u64 targets)
+{
+	while (targets)
+		push_move(moves, from, bb_pop_lsb(&targets), 0, CHESS_MOVE_NORMAL);
 }
 
-static void 
-generate_knight_moves(Game* game, s32 x, s32 y, Gen_Moves* moves)
+static void
+push_pawn_move(Gen_Moves* moves, s32 from, s32 to)
 {
-	Chess_Move mv = {0};
-	mv.from_x = x;
-	mv.from_y = y;
-
-	// L up left
-	mv.to_x = x - 1;
-	mv.to_y = y + 2;
-	if(is_valid_move(game, mv.from_x, mv.from_y, mv.to_x, mv.to_y, mv.promotion_piece)) {
-		array_push(moves->move, mv);
+	if (to >= 56 || to < 8) {
+		push_move(moves, from, to, CHESS_PROMOTE_QUEEN, CHESS_MOVE_PROMOTION);
+		push_move(moves, from, to, CHESS_PROMOTE_ROOK, CHESS_MOVE_PROMOTION);
+		push_move(moves, from, to, CHESS_PROMOTE_BISHOP, CHESS_MOVE_PROMOTION);
+		push_move(moves, from, to, CHESS_PROMOTE_KNIGHT, CHESS_MOVE_PROMOTION);
+	} else {
+		push_move(moves, from, to, 0, CHESS_MOVE_NORMAL);
 	}
+}
 
-	// L up right
-	mv.to_x = x + 1;
-	mv.to_y = y + 2;
-	if(is_valid_move(game, mv.from_x, mv.from_y, mv.to_x, mv.to_y, mv.promotion_piece)) {
-		array_push(moves->move, mv);
-	}
+// Legal en passant can still expose the king along the rank both pawns leave,
+// so it is tested by replaying the capture on the occupancy
+static bool
+en_passant_legal(Position* pos, s32 from, s32 to, s32 king, Chess_Color us)
+{
+    const Chess_Bitboards* bb = &pos->bb;
+    Chess_Color them = !us;
+    s32 captured = (us == CHESS_COLOR_WHITE) ? to - 8 : to + 8;
+    u64 occupancy = ((bb->color[0] | bb->color[1]) ^ (1ULL << from) ^ (1ULL << captured)) | (1ULL << to);
+    Chess_Piece base = (them == CHESS_COLOR_WHITE) ? CHESS_WHITE_KING : CHESS_BLACK_KING;
+    u64 queens = bb->piece[base + (CHESS_WHITE_QUEEN - CHESS_WHITE_KING)];
+    u64 rooks = bb->piece[base + (CHESS_WHITE_ROOK - CHESS_WHITE_KING)] | queens;
+    u64 bishops = bb->piece[base + (CHESS_WHITE_BISHOP - CHESS_WHITE_KING)] | queens;
+    return !(bb_rook_attacks(king, occupancy) & rooks) && !(bb_bishop_attacks(king, occupancy) & bishops);
+}
 
-	// L down left
-	mv.to_x = x - 1;
-	mv.to_y = y - 2;
-	if(is_valid_move(game, mv.from_x, mv.from_y, mv.to_x, mv.to_y, mv.promotion_piece)) {
-		array_push(moves->move, mv);
-	}
+// Generates only legal moves for the pieces of the side to move in from_mask,
+// restricted to the Gen_Stage bits in stages. Promotions belong to the capture stage.
+// Checkers and pinned pieces are computed once, so no move has to be tried on the board.
+// Stops after the piece that brings the count to limit, king moves are tried first
+// since they are the only ones possible in double check.
+static s32
+generate_legal(Position* pos, Gen_Moves* moves, u64 from_mask, s32 stages, s32 limit)
+{
+    const Chess_Bitboards* bb = &pos->bb;
+    Chess_Color us = (pos->white_turn) ? CHESS_COLOR_WHITE : CHESS_COLOR_BLACK;
+    Chess_Color them = !us;
+    Chess_Piece base = (us == CHESS_COLOR_WHITE) ? CHESS_WHITE_KING : CHESS_BLACK_KING;
+    Chess_Piece enemy = (us == CHESS_COLOR_WHITE) ? CHESS_BLACK_KING : CHESS_WHITE_KING;
+
+    Chess_Piece queen_piece  = base + (CHESS_WHITE_QUEEN - CHESS_WHITE_KING);
+    Chess_Piece rook_piece   = base + (CHESS_WHITE_ROOK - CHESS_WHITE_KING);
+    Chess_Piece knight_piece = base + (CHESS_WHITE_KNIGHT - CHESS_WHITE_KING);
+    Chess_Piece bishop_piece = base + (CHESS_WHITE_BISHOP - CHESS_WHITE_KING);
+    Chess_Piece pawn_piece   = base + (CHESS_WHITE_PAWN - CHESS_WHITE_KING);
+
+    u64 own = bb->color[us];
+    u64 other = bb->color[them];
+    u64 occupancy = own | other;
+
+    // Target squares of the pieces, pawns are sorted by the stages themselves
+    u64 stage_mask = ((stages & GEN_CAPTURES) ? other : 0) | ((stages & GEN_QUIETS) ? ~occupancy : 0);
+
+    s32 king = pos->king_square[us];
+    if (king < 0)
+        return moves->count;
+
+    u64 enemy_queens = bb->piece[enemy + (CHESS_WHITE_QUEEN - CHESS_WHITE_KING)];
+    u64 enemy_rooks = bb->piece[enemy + (CHESS_WHITE_ROOK - CHESS_WHITE_KING)] | enemy_queens;
+    u64 enemy_bishops = bb->piece[enemy + (CHESS_WHITE_BISHOP - CHESS_WHITE_KING)] | enemy_queens;
+
+    u64 checkers =
+        (bb_pawn_attacks[us][king] & bb->piece[enemy + (CHESS_WHITE_PAWN - CHESS_WHITE_KING)]) |
+        (bb_knight_attacks[king] & bb->piece[enemy + (CHESS_WHITE_KNIGHT - CHESS_WHITE_KING)]) |
+        (bb_bishop_attacks(king, occupancy) & enemy_bishops) |
+        (bb_rook_attacks(king, occupancy) & enemy_rooks);
+
+    // King moves, the king is taken off the board so it can't step back along a checking ray
+    u64 danger = attacked_squares(bb, them, occupancy & ~(1ULL << king));
+    if (from_mask & (1ULL << king)) {
+        push_targets(moves, king, bb_king_attacks[king] & stage_mask & ~danger);
+        if (moves->count >= limit)
+            return moves->count;
+
+        // Castling, the rook must still be in its corner and the king may not pass an attacked square
+        s32 home = (us == CHESS_COLOR_WHITE) ? 0 : 56;
+        bool short_castle = (us == CHESS_COLOR_WHITE) ? pos->white_short_castle_valid : pos->black_short_castle_valid;
+        bool long_castle = (us == CHESS_COLOR_WHITE) ? pos->white_long_castle_valid : pos->black_long_castle_valid;
+        if (!checkers && king == home + 4 && (stages & GEN_QUIETS)) {
+            if (short_castle && (bb->piece[rook_piece] & (1ULL << (home + 7))) &&
+                !(occupancy & bb_between[king][home + 7]) && !(danger & ((1ULL << (home + 5)) | (1ULL << (home + 6)))))
+                push_move(moves, king, home + 6, 0, CHESS_MOVE_CASTLE);
+            if (long_castle && (bb->piece[rook_piece] & (1ULL << home)) &&
+                !(occupancy & bb_between[king][home]) && !(danger & ((1ULL << (home + 3)) | (1ULL << (home + 2)))))
+                push_move(moves, king, home + 2, 0, CHESS_MOVE_CASTLE);
+        }
+    }
 
-	// L down right
-	mv.to_x = x + 1;
-	mv.to_y = y - 2;
-	if(is_valid_move(game, mv.from_x, mv.from_y, mv.to_x, mv.to_y, mv.promotion_piece)) {
-		array_push(moves->move, mv);
-	}
+    // In double check only the king can move
+    if (bb_popcount(checkers) > 1)
+        return moves->count;
 
-	// L right up
-	mv.to_x = x + 2;
-	mv.to_y = y + 1;
-	if(is_valid_move(game, mv.from_x, mv.from_y, mv.to_x, mv.to_y, mv.promotion_piece)) {
-		array_push(moves->move, mv);
-	}
+    // Squares that resolve a single check: capturing the checker or blocking its ray
+    u64 evasion = ~0ULL;
+    if (checkers) {
+        s32 checker = bb_lsb(checkers);
+        evasion = checkers | bb_between[king][checker];
+    }
 
-	// L right down
-	mv.to_x = x + 2;
-	mv.to_y = y - 1;
-	if(is_valid_move(game, mv.from_x, mv.from_y, mv.to_x, mv.to_y, mv.promotion_piece)) {
-		array_push(moves->move, mv);
-	}
+    // Own pieces standing alone between the king and an enemy slider can only move along that line
+    u64 pinned = 0;
+    u64 snipers = (bb_rook_attacks(king, other) & enemy_rooks) | (bb_bishop_attacks(king, other) & enemy_bishops);
+    while (snipers) {
+        u64 blockers = bb_between[king][bb_pop_lsb(&snipers)] & occupancy;
+        if (bb_popcount(blockers) == 1)
+            pinned |= blockers & own;
+    }
 
-	// L left up
-	mv.to_x = x - 2;
-	mv.to_y = y + 1;
-	if(is_valid_move(game, mv.from_x, mv.from_y, mv.to_x, mv.to_y, mv.promotion_piece)) {
-		array_push(moves->move, mv);
-	}
+    // Each piece type is walked from its own bitboard, queens once per direction set
+    u64 targets_mask = stage_mask & evasion;
+    u64 pieces = bb->piece[knight_piece] & from_mask & ~pinned; // a pinned knight can never move
+    while (pieces) {
+        s32 from = bb_pop_lsb(&pieces);
+        push_targets(moves, from, bb_knight_attacks[from] & targets_mask);
+        if (moves->count >= limit)
+            return moves->count;
+    }
 
-	// L left down
-	mv.to_x = x - 2;
-	mv.to_y = y - 1;
-	if(is_valid_move(game, mv.from_x, mv.from_y, mv.to_x, mv.to_y, mv.promotion_piece)) {
-		array_push(moves->move, mv);
-	}
-}
+    pieces = (bb->piece[bishop_piece] | bb->piece[queen_piece]) & from_mask;
+    while (pieces) {
+        s32 from = bb_pop_lsb(&pieces);
+        u64 targets = bb_bishop_attacks(from, occupancy) & targets_mask;
+        if (pinned & (1ULL << from))
+            targets &= bb_line[king][from];
+        push_targets(moves, from, targets);
+        if (moves->count >= limit)
+            return moves->count;
+    }
 
-static void 
-generate_rook_moves(Game* game, s32 x, s32 y, Gen_Moves* moves)
-{
-	Chess_Move mv = {0};
-	mv.from_x = x;
-	mv.from_y = y;
-
-	// up
-	mv.to_x = x;
-	for (s32 i = y + 1; i < 8; ++i) {
-		mv.to_y = i;
-		if(is_valid_move(game, mv.from_x, mv.from_y, mv.to_x, mv.to_y, mv.promotion_piece)) {
-			array_push(moves->move, mv);
-		} else
-			break;
-	}
+    pieces = (bb->piece[rook_piece] | bb->piece[queen_piece]) & from_mask;
+    while (pieces) {
+        s32 from = bb_pop_lsb(&pieces);
+        u64 targets = bb_rook_attacks(from, occupancy) & targets_mask;
+        if (pinned & (1ULL << from))
+            targets &= bb_line[king][from];
+        push_targets(moves, from, targets);
+        if (moves->count >= limit)
+            return moves->count;
+    }
 
-	// down
-	for (s32 i = y - 1; i >= 0; --i) {
-		mv.to_y = i;
-		if(is_valid_move(game, mv.from_x, mv.from_y, mv.to_x, mv.to_y, mv.promotion_piece)) {
-			array_push(moves->move, mv);
-		} else
-			break;
-	}
+    u64 pawns = bb->piece[pawn_piece] & from_mask;
+    s32 forward = (us == CHESS_COLOR_WHITE) ? 8 : -8;
+    u64 start_rank = (us == CHESS_COLOR_WHITE) ? (BB_RANK_1 << 8) : (BB_RANK_8 >> 8);
+    u64 promotion_rank = (us == CHESS_COLOR_WHITE) ? BB_RANK_8 : BB_RANK_1;
+    u64 push_mask = ((stages & GEN_CAPTURES) ? promotion_rank : 0) | ((stages & GEN_QUIETS) ? ~promotion_rank : 0);
+    u64 capture_mask = (stages & GEN_CAPTURES) ? other : 0;
+    while (pawns) {
+        s32 from = bb_pop_lsb(&pawns);
+        u64 allowed = evasion;
+        if (pinned & (1ULL << from))
+            allowed &= bb_line[king][from];
+
+        s32 to = from + forward;
+        if (!(occupancy & (1ULL << to))) {
+            if (allowed & push_mask & (1ULL << to))
+                push_pawn_move(moves, from, to);
+            if ((start_rank & (1ULL << from)) && !(occupancy & (1ULL << (to + forward))) && (allowed & push_mask & (1ULL << (to + forward))))
+                push_move(moves, from, to + forward, 0, CHESS_MOVE_NORMAL);
+        }
 
-	// left
-	mv.to_y = y;
-	for (s32 i = x - 1; i >= 0; --i) {
-		mv.to_x = i;
-		if(is_valid_move(game, mv.from_x, mv.from_y, mv.to_x, mv.to_y, mv.promotion_piece)) {
-			array_push(moves->move, mv);
-		} else
-			break;
-	}
+        u64 captures = bb_pawn_attacks[us][from] & capture_mask & allowed;
+        while (captures)
+            push_pawn_move(moves, from, bb_pop_lsb(&captures));
+
+        // En passant also resolves a check given by the pawn that just moved
+        s32 ep = pos->en_passant_square;
+        if (ep >= 0 && (stages & GEN_CAPTURES) && (bb_pawn_attacks[us][from] & (1ULL << ep))) {
+            s32 captured = ep - forward;
+            bool resolves = (evasion & (1ULL << ep)) || (checkers & (1ULL << captured));
+            bool on_pin_line = !(pinned & (1ULL << from)) || (bb_line[king][from] & (1ULL << ep));
+            if (resolves && on_pin_line && en_passant_legal(pos, from, ep, king, us))
+                push_move(moves, from, ep, 0, CHESS_MOVE_EN_PASSANT);
+        }
+        if (moves->count >= limit)
+            return moves->count;
+    }
 
-	// right
-	for (s32 i = x + 1; i < 8; ++i) {
-		mv.to_x = i;
-		if(is_valid_move(game, mv.from_x, mv.from_y, mv.to_x, mv.to_y, mv.promotion_piece)) {
-			array_push(moves->move, mv);
-		} else
-			break;
-	}
+    return moves->count;
 }
 
-static void
-generate_queen_moves(Game* game, s32 x, s32 y, Gen_Moves* moves)
+// Legal moves of a bare position, for code that copies positions instead of games
+s32
+position_generate_moves(Position* pos, Gen_Moves* moves)
 {
-	generate_rook_moves(game, x, y, moves);
-	generate_bishop_moves(game, x, y, moves);
+    moves->count = 0;
+    return generate_legal(pos, moves, ~0ULL, GEN_ALL, MAX_MOVES);
 }
 
-static void 
-generate_king_moves(Game* game, s32 x, s32 y, Gen_Moves* moves)
-{
-	Chess_Move mv = {0};
-	mv.from_x = x;
-	mv.from_y = y;
-
-    // Normal moves
-    mv.to_x = x + 1; // right
-    mv.to_y = y;
-    if(is_valid_move(game, mv.from_x, mv.from_y, mv.to_x, mv.to_y, mv.promotion_piece)) 
-        array_push(moves->move, mv);
-
-    mv.to_x = x - 1; // left
-    mv.to_y = y;
-    if(is_valid_move(game, mv.from_x, mv.from_y, mv.to_x, mv.to_y, mv.promotion_piece)) 
-        array_push(moves->move, mv);
-
-    mv.to_x = x; // top
-    mv.to_y = y + 1;
-    if(is_valid_move(game, mv.from_x, mv.from_y, mv.to_x, mv.to_y, mv.promotion_piece)) 
-        array_push(moves->move, mv);
-    
-    mv.to_x = x; // bottom
-    mv.to_y = y - 1;
-    if(is_valid_move(game, mv.from_x, mv.from_y, mv.to_x, mv.to_y, mv.promotion_piece)) 
-        array_push(moves->move, mv);
-
-    mv.to_x = x - 1; // top left
-    mv.to_y = y + 1;
-    if(is_valid_move(game, mv.from_x, mv.from_y, mv.to_x, mv.to_y, mv.promotion_piece)) 
-        array_push(moves->move, mv);
-    
-    mv.to_x = x + 1; // top right
-    mv.to_y = y + 1;
-    if(is_valid_move(game, mv.from_x, mv.from_y, mv.to_x, mv.to_y, mv.promotion_piece)) 
-        array_push(moves->move, mv);
-
-    mv.to_x = x - 1; // bot left
-    mv.to_y = y - 1;
-    if(is_valid_move(game, mv.from_x, mv.from_y, mv.to_x, mv.to_y, mv.promotion_piece)) 
-        array_push(moves->move, mv);
-    
-    mv.to_x = x + 1; // bot right
-    mv.to_y = y - 1;
-    if(is_valid_move(game, mv.from_x, mv.from_y, mv.to_x, mv.to_y, mv.promotion_piece)) 
-        array_push(moves->move, mv);
-
-    mv.to_x = x + 2; // castle
-    mv.to_y = y;
-    if(is_valid_move(game, mv.from_x, mv.from_y, mv.to_x, mv.to_y, mv.promotion_piece)) 
-        array_push(moves->move, mv);
-
-    mv.to_x = x - 2; // castle
-    mv.to_y = y;
-    if(is_valid_move(game, mv.from_x, mv.from_y, mv.to_x, mv.to_y, mv.promotion_piece)) 
-        array_push(moves->move, mv);
+bool
+position_in_check(Position* pos)
+{
+    return (pos->white_turn) ? white_in_check(pos) : black_in_check(pos);
 }
 
 s32 
 generate_possible_moves(Game* game, Gen_Moves* moves) 
 {
-    moves->move = array_new(Chess_Move);
-
-    for (s32 y = 0; y < 8; ++y) {
-        for (s32 x = 0; x < 8; ++x) {
-            Chess_Piece p = game->board[y][x];
-            if (game->white_turn && is_black(p))
-                continue;
-            if (!game->white_turn && is_white(p))
-                continue;
-            switch (p) 
-            {
-                case CHESS_BLACK_PAWN:
-                case CHESS_WHITE_PAWN:		generate_pawn_moves(game, x, y, moves); break;
-                case CHESS_BLACK_BISHOP:
-                case CHESS_WHITE_BISHOP:	generate_bishop_moves(game, x, y, moves); break;
-                case CHESS_BLACK_KNIGHT:
-                case CHESS_WHITE_KNIGHT:	generate_knight_moves(game, x, y, moves); break;
-                case CHESS_BLACK_ROOK:
-                case CHESS_WHITE_ROOK:		generate_rook_moves(game, x, y, moves); break;
-                case CHESS_BLACK_QUEEN:
-                case CHESS_WHITE_QUEEN:		generate_queen_moves(game, x, y, moves); break;
-                case CHESS_BLACK_KING:
-                case CHESS_WHITE_KING:		generate_king_moves(game, x, y, moves); break;
-                default: break;
-            }
-        }
-    }
-    return array_length(moves->move);
+    moves->count = 0;
+    return generate_legal(&game->pos, moves, ~0ULL, GEN_ALL, MAX_MOVES);
 }
 
 s32 
 generate_possible_moves_from_square(Game* game, Gen_Moves* moves, s32 x, s32 y) 
 {
-    moves->move = array_new(Chess_Move);
-
-    Chess_Piece p = game->board[y][x];
-    if (game->white_turn && is_black(p))
-        return 0;
-    if (!game->white_turn && is_white(p))
-        return 0;
-    switch (p) 
-    {
-        case CHESS_BLACK_PAWN:
-        case CHESS_WHITE_PAWN:		generate_pawn_moves(game, x, y, moves); break;
-        case CHESS_BLACK_BISHOP:
-        case CHESS_WHITE_BISHOP:	generate_bishop_moves(game, x, y, moves); break;
-        case CHESS_BLACK_KNIGHT:
-        case CHESS_WHITE_KNIGHT:	generate_knight_moves(game, x, y, moves); break;
-        case CHESS_BLACK_ROOK:
-        case CHESS_WHITE_ROOK:		generate_rook_moves(game, x, y, moves); break;
-        case CHESS_BLACK_QUEEN:
-        case CHESS_WHITE_QUEEN:		generate_queen_moves(game, x, y, moves); break;
-        case CHESS_BLACK_KING:
-        case CHESS_WHITE_KING:		generate_king_moves(game, x, y, moves); break;
-        default: break;
-    }
-    return array_length(moves->move);
+    moves->count = 0;
+    return generate_legal(&game->pos, moves, BB_SQUARE(x, y), GEN_ALL, MAX_MOVES);
 }
 
 s32
 generate_all_valid_moves_from_square(Game* game, Gen_Moves* moves, s32 x, s32 y)
 {
-    generate_possible_moves_from_square(game, moves, x, y);
-
-    s32 mv_count = 0;
-    for(int i = array_length(moves->move)-1; i >= 0; --i) {
-        if(game_move(game, moves->move[i].from_x, moves->move[i].from_y, moves->move[i].to_x, moves->move[i].to_y, moves->move[i].promotion_piece, true, 0)) {
-            mv_count++;
-        } else {
-            array_remove_ordered(moves->move, i);
-        }
-    }
-    return mv_count;
+    return generate_possible_moves_from_square(game, moves, x, y);
 }
 
-bool
-check_sufficient_material(Game* game)
+// Appends the legal captures and promotions, en passant included
+s32
+generate_captures(Game* game, Gen_Moves* moves)
 {
-    Chess_Piece hist[CHESS_COUNT] = {0};
-    s32 total = 0;
-    s32 dark_square_bishop = 0;
-    s32 light_square_bishop = 0;
-    for(s32 y = 0; y < 8; ++y) {
-        for(s32 x = 0; x < 8; ++x) {
-            Chess_Piece p = game->board[y][x];
-            hist[p]++;
-            if(p != CHESS_NONE)
-                total++;
-            if(p == CHESS_BLACK_BISHOP || p == CHESS_WHITE_BISHOP) {
-                if((x + y) % 2 == 0)
-                    dark_square_bishop++;
-                else
-                    light_square_bishop++;
-            }
-        }
-    }
+    return generate_legal(&game->pos, moves, ~0ULL, GEN_CAPTURES, MAX_MOVES);
+}
 
-    // Two kings
-    if(total == 2)
-        return false;
+// Appends the legal moves that neither capture nor promote, castling included
+s32
+generate_quiets(Game* game, Gen_Moves* moves)
+{
+    return generate_legal(&game->pos, moves, ~0ULL, GEN_QUIETS, MAX_MOVES);
+}
 
-    // King and bishop
-    if(total == 3 && hist[CHESS_WHITE_BISHOP] == 1 || total == 3 && hist[CHESS_BLACK_BISHOP] == 1)
-        return false;
+// Legal replies to a check, nothing when the side to move isn't in check.
+// The legal generator already limits itself to evasions in check.
+s32
+generate_evasions(Game* game, Gen_Moves* moves)
+{
+    moves->count = 0;
+    bool in_check = (game->pos.white_turn) ? white_in_check(&game->pos) : black_in_check(&game->pos);
+    if (!in_check)
+        return 0;
+    return generate_legal(&game->pos, moves, ~0ULL, GEN_ALL, MAX_MOVES);
+}
 
-    // King and knight
-    if(total == 3 && hist[CHESS_WHITE_KNIGHT] == 1 || total == 3 && hist[CHESS_BLACK_KNIGHT] == 1)
-        return false;
+bool
+game_has_legal_move(Game* game)
+{
+    Gen_Moves moves;
+    moves.count = 0;
+    return generate_legal(&game->pos, &moves, ~0ULL, GEN_ALL, 1) > 0;
+}
 
-    // King and bishop vs king bishop of the same color
-    if(total == 4 && hist[CHESS_WHITE_BISHOP] == 1 && hist[CHESS_BLACK_BISHOP] == 1 && (light_square_bishop == 2 || dark_square_bishop == 2))
-        return false;
+Chess_Status
+game_status(Game* game)
+{
+    if (game_has_legal_move(game))
+        return CHESS_STATUS_PLAYING;
+    bool in_check = (game->pos.white_turn) ? white_in_check(&game->pos) : black_in_check(&game->pos);
+    return (in_check) ? CHESS_STATUS_CHECKMATE : CHESS_STATUS_STALEMATE;
+}
 
-    return true;
+bool
+check_sufficient_material(Game* game)
+{
+    return game_material_class(game) != MATERIAL_INSUFFICIENT;
 }
 
+// Only positions with the same side to move can repeat, so the keys are compared
+// two plies apart, and nothing before the last pawn move or capture can repeat
 bool
 check_repetition(Game* game)
 {
-    s32 sum = 0;
     Game_History* history = ((Game_History*)game->history);
-    for(s32 i = history->repetition_index_check; i < array_length(history->game) - 1; ++i) {
-        Game* gm = &history->game[i]; 
-        if(memcmp(gm->board, game->board, sizeof(game->board)) == 0) {
-            if (
-                gm->white_long_castle_valid == game->white_long_castle_valid &&
-                gm->white_short_castle_valid == game->white_short_castle_valid &&
-                gm->black_long_castle_valid == game->black_long_castle_valid &&
-                gm->black_short_castle_valid == game->black_short_castle_valid)
-            {
-                sum++;
-            }
-        }
+    s32 last = array_length(history->keys) - 1;
+    s32 first = MAX(0, last - game->pos.move_draw_count);
+    u64 key = history->keys[last];
+
+    s32 sum = 0;
+    for(s32 i = last - 2; i >= first; i -= 2) {
+        if(history->keys[i] == key)
+            sum++;
     }
 
     return sum >= 2;
 }
 
+// Takes back the last ply by unmaking it, or by restoring the keyframe saved
+// before it. Either way the side that moved gets its clock back as it was before
+// the move, without the increment.
 void
 game_undo(Game* game)
 {
     Game_History* history = ((Game_History*)game->history);
-    if (history && array_length(history->game) > 1) {
-        *game = history->game[array_length(history->game) - 2];
-        array_length(history->game)--;
-        history->repetition_index_check = 0;
+    if (!history || array_length(history->entries) == 0)
+        return;
+
+    Game_History_Entry entry = array_pop(history->entries);
+    array_length(history->keys)--;
+
+    if (entry.move == CHESS_MOVE_NONE) {
+        Game* keyframe = array_pop(history->keyframes);
+        *game = *keyframe;
+        keyframe_free(keyframe);
+        game->history = (struct Game_History*)history;
+        return;
     }
+
+    game_unmake_move(game, entry.move, &entry.undo);
+    if (game->pos.white_turn)
+        game->white_time_ms = entry.mover_time_ms;
+    else
+        game->black_time_ms = entry.mover_time_ms;
+    game->winner = PLAYER_NONE;
+    game->move_count--;
+
+    // The last move displayed is the one before, unknown past a keyframe
+    s32 count = array_length(history->entries);
+    if (count > 0 && history->entries[count - 1].move != CHESS_MOVE_NONE) {
+        game->last_move = played_move(game, history->entries[count - 1].move);
+    } else {
+        memset(&game->last_move, 0, sizeof(game->last_move));
+        game->last_move.start = true;
+    }
+}
+
+// Records a position that replaced the game as a whole, i.e. received from the
+// network. When it is one move away from before, that move is recorded so it can
+// be unmade, otherwise before is kept as a keyframe.
+void
+game_history_record_update(Game* game, const Game* before)
+{
+    Game_History* history = ((Game_History*)game->history);
+    Chess_Move move = game->last_move;
+
+    if (!move.start && inside_board(move.from_x, move.from_y) && inside_board(move.to_x, move.to_y) &&
+        before->pos.board[move.from_y][move.from_x] == move.moved_piece && move.moved_piece != CHESS_NONE)
+    {
+        Game replay = *before;
+        Chess_Undo undo;
+        Chess_Packed_Move packed = chess_move_pack(&replay, move);
+        game_make_move(&replay, packed, &undo);
+        if (replay.pos.hash == game->pos.hash) {
+            history_push_move(game, packed, &undo, (before->pos.white_turn) ? before->white_time_ms : before->black_time_ms);
+            return;
+        }
+    }
+
+    Game_History_Entry entry = {0};
+    entry.move = CHESS_MOVE_NONE;
+    array_push(history->entries, entry);
+    Game* keyframe = keyframe_alloc();
+    *keyframe = *before;
+    array_push(history->keyframes, keyframe);
+    array_push(history->keys, game->pos.hash);
+}
+
+// Forgets the last ply without touching the game, used when the position after
+// an undo was received from the network
+void
+game_history_drop(Game* game)
+{
+    Game_History* history = ((Game_History*)game->history);
+    if (!history || array_length(history->entries) == 0)
+        return;
+
+    Game_History_Entry entry = array_pop(history->entries);
+    array_length(history->keys)--;
+    if (entry.move == CHESS_MOVE_NONE)
+        keyframe_free(array_pop(history->keyframes));
 }
\ No newline at end of file
@@ -1,5 +1,5 @@
 #pragma once
-#include "os.h"
+#include "types.h"
 
 #define LAST_RANK 7
 #define FIRST_RANK 0
@@ -36,6 +36,46 @@ typedef enum {
     PLAYER_DRAW_50_MOVE,
 } Player;
 
+// Material signature, a 4 bit count per field, white fields first then black.
+// Bishops are counted per square color since same colored bishops can't mate.
+typedef enum {
+    MATERIAL_PAWN = 0,
+    MATERIAL_KNIGHT,
+    MATERIAL_LIGHT_BISHOP,
+    MATERIAL_DARK_BISHOP,
+    MATERIAL_ROOK,
+    MATERIAL_QUEEN,
+    MATERIAL_FIELD_COUNT,
+} Material_Field;
+
+#define MATERIAL_SHIFT(COLOR, FIELD) (4 * ((COLOR) * MATERIAL_FIELD_COUNT + (FIELD)))
+#define MATERIAL_COUNT(SIGNATURE, COLOR, FIELD) (((SIGNATURE) >> MATERIAL_SHIFT(COLOR, FIELD)) & 0xf)
+
+// What the material alone says about the game
+typedef enum {
+    MATERIAL_NORMAL = 0,
+    MATERIAL_INSUFFICIENT,  // no sequence of moves can mate, the game is drawn
+    MATERIAL_DRAWISH,       // mate is possible but can't be forced, e.g. two knights or minor against minor
+    MATERIAL_MATING,        // lone king against two minors that force mate, e.g. bishop and knight
+} Material_Class;
+
+// Whether the side to move can still play
+typedef enum {
+    CHESS_STATUS_PLAYING = 0,
+    CHESS_STATUS_CHECKMATE,
+    CHESS_STATUS_STALEMATE,
+} Chess_Status;
+
+typedef enum {
+    CHESS_COLOR_WHITE = 0,
+    CHESS_COLOR_BLACK = 1,
+} Chess_Color;
+
+typedef struct {
+    u64 piece[CHESS_COUNT]; // indexed by Chess_Piece, piece[CHESS_NONE] is unused
+    u64 color[2];           // occupancy indexed by Chess_Color
+} Chess_Bitboards;
+
 typedef struct {
     bool start;
     s32 from_x;
@@ -46,18 +86,66 @@ typedef struct {
     Chess_Piece moved_piece;
 } Chess_Move;
 
+// Move packed in 16 bits: from square in bits 0-5, to square in bits 6-11,
+// promotion in bits 12-13 and a Chess_Move_Flag in bits 14-15. Squares are y * 8 + x.
+// Used by move lists and the history, Chess_Move is kept for the UI and the network.
+typedef u16 Chess_Packed_Move;
+
+typedef enum {
+    CHESS_MOVE_NORMAL     = 0,
+    CHESS_MOVE_PROMOTION  = 1,
+    CHESS_MOVE_EN_PASSANT = 2,
+    CHESS_MOVE_CASTLE     = 3,
+} Chess_Move_Flag;
+
+// Promotion field of a packed move
+typedef enum {
+    CHESS_PROMOTE_KNIGHT = 0,
+    CHESS_PROMOTE_BISHOP = 1,
+    CHESS_PROMOTE_ROOK   = 2,
+    CHESS_PROMOTE_QUEEN  = 3,
+} Chess_Promotion;
+
+#define CHESS_MOVE_NONE 0  // a1 to a1, never a real move
+#define CHESS_PACK_MOVE(FROM, TO, PROMOTION, FLAG) ((Chess_Packed_Move)((FROM) | ((TO) << 6) | ((PROMOTION) << 12) | ((FLAG) << 14)))
+#define CHESS_MOVE_FROM(M) ((M) & 0x3f)
+#define CHESS_MOVE_TO(M) (((M) >> 6) & 0x3f)
+#define CHESS_MOVE_PROMOTION(M) (((M) >> 12) & 0x3)
+#define CHESS_MOVE_FLAG(M) ((M) >> 14)
+
+#if defined(_MSC_VER)
+#define CHESS_ALIGN(N) __declspec(align(N))
+#else
+#define CHESS_ALIGN(N) __attribute__((aligned(N)))
+#endif
+
+// Rules state of a position, everything move generation and make/unmake read
+// or write. Holds no pointers and fills whole cache lines, so copying one is a
+// few block moves. Heap copies must come from an allocator that keeps the alignment.
+typedef struct CHESS_ALIGN(64) {
+    Chess_Bitboards bb;     // mirrors board, bit index is y * 8 + x
+    u64 hash;               // Zobrist key of pieces, side to move, castling and en passant
+    u64 material;           // material signature, see Material_Field
+    s32 psq[2];             // sums of eval_psq by Eval_Stage, white minus black
+    u8  board[8][8];        // Chess_Piece per square
+    s8  king_square[2];     // indexed by Chess_Color, -1 when the side has no king
+    s8  en_passant_square;  // square a pawn can capture on en passant, -1 if none
+    u8  white_turn;
+    u8  white_long_castle_valid;
+    u8  white_short_castle_valid;
+    u8  black_long_castle_valid;
+    u8  black_short_castle_valid;
+    s16 move_draw_count;    // plies since the last capture or pawn move
+    u8  attack_map_valid;   // bit per Chess_Color, cleared whenever a piece moves
+    u64 attack_map[2];      // squares attacked by each Chess_Color, read through game_attack_map
+} Position;
+
+// A game in progress, the position plus the session, clock and UI state
 typedef struct {
-    Chess_Piece board[8][8];
-    Chess_Piece sim_board[8][8];
+    Position pos;
 
     Player winner;
-    bool white_turn;
-    bool white_long_castle_valid;
-    bool white_short_castle_valid;
-    bool black_long_castle_valid;
-    bool black_short_castle_valid;
     Chess_Move last_move;
-    s32 move_draw_count;
     s32 move_count;
 
     r64 white_time_ms;
@@ -72,17 +160,72 @@ typedef struct {
     bool is_undo;
 } Game;
 
+// No legal position has more than 218 moves
+#define MAX_MOVES 256
+
+// Filled by the generate functions, can live on the stack
 typedef struct {
-    Chess_Move* move;
+    s32 count;
+    Chess_Packed_Move move[MAX_MOVES];
 } Gen_Moves;
 
+// Which moves a generator emits, promotions count as captures
+typedef enum {
+    GEN_CAPTURES = 1 << 0,
+    GEN_QUIETS   = 1 << 1,
+    GEN_ALL      = GEN_CAPTURES | GEN_QUIETS,
+} Gen_Stage;
+
+// State that game_make_move can't recover from the move itself
+typedef struct {
+    u8  captured;           // Chess_Piece, includes a pawn taken en passant
+    u8  castle_rights;
+    s8  en_passant_square;
+    s16 move_draw_count;
+} Chess_Undo;
+
+// One ply of history, enough to unmake it. Plies that can't be unmade, like a
+// position received from the network that isn't one move away, are keyframes
+// and restore a full copy of the game instead.
+typedef struct {
+    Chess_Packed_Move move; // CHESS_MOVE_NONE marks a keyframe
+    Chess_Undo undo;
+    r64 mover_time_ms;      // clock of the side that moved, as it was before the move
+} Game_History_Entry;
+
 typedef struct {
-    Game* game;
-    s32 repetition_index_check;
+    Game_History_Entry* entries;
+    Game** keyframes;       // game before each keyframe entry, in order, see keyframe_alloc
+    u64*  keys;             // Position.hash after every ply, keys[0] is the starting position
 } Game_History;
 
 void game_new(Game* game);
 int  game_move(Game* game, s32 from_x, s32 from_y, s32 to_x, s32 to_y, Chess_Piece promotion_choice, bool simulate, bool* capt);
 bool game_move_apply(Game* game, Chess_Move move, bool simulate, bool* capt) ;
 void game_undo(Game* game);
-s32  generate_all_valid_moves_from_square(Game* game, Gen_Moves* moves, s32 x, s32 y);
\ No newline at end of file
+void game_history_record_update(Game* game, const Game* before);
+void game_history_drop(Game* game);
+void game_make_move(Game* game, Chess_Packed_Move move, Chess_Undo* undo);
+void game_unmake_move(Game* game, Chess_Packed_Move move, const Chess_Undo* undo);
+Chess_Packed_Move chess_move_pack(Game* game, Chess_Move move);
+Chess_Move        chess_move_unpack(Game* game, Chess_Packed_Move move);
+void game_sync_bitboards(Game* game);
+void position_make_move(Position* pos, Chess_Packed_Move move, Chess_Undo* undo);
+void position_unmake_move(Position* pos, Chess_Packed_Move move, const Chess_Undo* undo);
+void position_sync(Position* pos);
+s32  position_generate_moves(Position* pos, Gen_Moves* moves);
+bool position_in_check(Position* pos);
+u64  position_attack_map(Position* pos, Chess_Color by);
+u64  position_attackers_to(Position* pos, s32 square, u64 occupancy);
+s32  parse_fen(s8* fen, Game* game);
+s32  generate_possible_moves(Game* game, Gen_Moves* moves);
+s32  generate_possible_moves_from_square(Game* game, Gen_Moves* moves, s32 x, s32 y);
+s32  generate_all_valid_moves_from_square(Game* game, Gen_Moves* moves, s32 x, s32 y);
+s32  generate_captures(Game* game, Gen_Moves* moves);
+s32  generate_quiets(Game* game, Gen_Moves* moves);
+s32  generate_evasions(Game* game, Gen_Moves* moves);
+bool check_repetition(Game* game);
+bool game_has_legal_move(Game* game);
+Chess_Status game_status(Game* game);
+Material_Class game_material_class(Game* game);
+u64  game_attack_map(Game* game, Chess_Color by);
\ No newline at end of file
@@ -2,6 +2,7 @@
 #include "input.h"
 #include "renderer.h"
 #include "gm.h"
+#include "see.h"
 #include <stb_image.h>
 #include <light_array.h>
 #include <float.h>
@@ -64,6 +65,8 @@ typedef struct {
     r64 clock;
 
     bool disable_both_move;
+    bool show_attacks;
+    bool show_hanging;
 
     bool premove;
     Chess_Move premove_move;
@@ -153,6 +156,18 @@ game_process_new_player(AppInterface* interf, Game* game, Server_Message* msg)
         interface_send_update(interf, (u8*)game, sizeof(Game));
 }
 
+// The board and en passant square of a peer index the bitboard, hash and
+// attack tables, anything out of range there is rejected
+static bool
+received_position_valid(const Position* pos)
+{
+    for (s32 y = 0; y < 8; ++y)
+        for (s32 x = 0; x < 8; ++x)
+            if (pos->board[y][x] >= CHESS_COUNT)
+                return false;
+    return pos->en_passant_square >= -1 && pos->en_passant_square < 64;
+}
+
 void
 game_process_update(AppInterface* chess, Game* game, Server_Message* msg)
 {
@@ -160,17 +175,22 @@ game_process_update(AppInterface* chess, Game* game, Server_Message* msg)
 	s32 index = msg->update.index;
 
     printf("Received update from %lld\n", id);
-    Game* received_game = (Game*)msg->data;
-    memcpy(game->board, received_game->board, sizeof(received_game->board));
+    // The message buffer has no alignment guarantee, copy the game out as bytes
+    // before reading any field. Derived state like the bitboards and hash is
+    // rebuilt rather than trusted.
+    Game received = {0};
+    Game* received_game = &received;
+    memcpy(received_game, msg->data, sizeof(Game));
+    if (!received_position_valid(&received_game->pos)) {
+        printf("Rejected invalid update from %lld\n", id);
+        return;
+    }
 
+    Game before = *game;
+    game->pos = received_game->pos;
     game->winner = received_game->winner;
-    game->white_turn = received_game->white_turn;
-    game->white_long_castle_valid = received_game->white_long_castle_valid;
-    game->white_short_castle_valid = received_game->white_short_castle_valid;
-    game->black_long_castle_valid = received_game->black_long_castle_valid;
-    game->black_short_castle_valid = received_game->black_short_castle_valid;
     game->last_move = received_game->last_move;
-    game->move_draw_count = received_game->move_draw_count;
+    game_sync_bitboards(game);
 
     game->white_time_ms = received_game->white_time_ms;
     game->black_time_ms = received_game->black_time_ms;
@@ -190,11 +210,10 @@ game_process_update(AppInterface* chess, Game* game, Server_Message* msg)
         game->im_white = false;
     }
     if(received_game->is_undo) {
-        if(array_length(((Game_History*)game->history)->game) > 1)
-            array_length(((Game_History*)game->history)->game)--;
+        game_history_drop(game);
         game->is_undo = false;
     } else {
-        array_push(((Game_History*)game->history)->game, *game);
+        game_history_record_update(game, &before);
     }
 
     play_piece_sound(chess, false);
@@ -376,7 +395,7 @@ interface_input(Chess_Interface interf, Game* game)
     AppInterface* chess = (AppInterface*)interf;
 	AppInput* input = &chess->input;
 
-    bool my_turn = (game->clock == 0) || (game->im_white && game->white_turn) || (!game->im_white && !game->white_turn);
+    bool my_turn = (game->clock == 0) || (game->im_white && game->pos.white_turn) || (!game->im_white && !game->pos.white_turn);
 
 	s32 xx = -1, yy = -1;
 	Hinp_Event ev = {0};
@@ -466,6 +485,8 @@ interface_input(Chess_Interface interf, Game* game)
                 switch (ev.keyboard.key) {
                     case 'R': game_new(game); interface_send_update(chess, (u8*)game, sizeof(Game)); break;
                     case 'T': chess->inverted_board = !chess->inverted_board; break;
+                    case 'A': chess->show_attacks = !chess->show_attacks; break;
+                    case 'H': chess->show_hanging = !chess->show_hanging; break;
                     case 'D': chess->disable_both_move = !chess->disable_both_move;
                     case VK_DOWN: game->white_time_ms -= (1000.0 * 60); game->black_time_ms -= (1000.0 * 60); break;
                     case VK_UP: game->white_time_ms += (1000.0 * 60); game->black_time_ms += (1000.0 * 60); break;
@@ -530,7 +551,7 @@ interface_render_clock(AppInterface* chess, Hobatch_Context* ctx, Game* game)
         r64 elapsed = (os_time_us() / 1000.0) - game->clock;
         game->clock = (os_time_us() / 1000.0);
 
-        if(game->white_turn)
+        if(game->pos.white_turn)
             game->white_time_ms -= elapsed;
         else
             game->black_time_ms -= elapsed;
@@ -597,7 +618,7 @@ interface_render(Chess_Interface interf, Hobatch_Context* ctx, Game* game)
     Chess_Piece piece_selected = CHESS_NONE;
 
     if(input->pressed) {
-        piece_selected = game->board[get_y(input->start_y, chess->inverted_board)][get_x(input->start_x, chess->inverted_board)];
+        piece_selected = game->pos.board[get_y(input->start_y, chess->inverted_board)][get_x(input->start_x, chess->inverted_board)];
         if(piece_selected == CHESS_WHITE_PAWN && get_y(input->start_y, chess->inverted_board) == 6) {
             piece_selected = piece_from_scroll(input, true);
         }
@@ -606,6 +627,11 @@ interface_render(Chess_Interface interf, Hobatch_Context* ctx, Game* game)
         }
     }
 
+    // Squares the side to move has to watch out for
+    u64 threats = (chess->show_attacks) ? game_attack_map(game, (game->pos.white_turn) ? CHESS_COLOR_BLACK : CHESS_COLOR_WHITE) : 0;
+    // Pieces of the side to move the opponent wins material by taking
+    u64 hanging = (chess->show_hanging) ? see_hanging(&game->pos, (game->pos.white_turn) ? CHESS_COLOR_WHITE : CHESS_COLOR_BLACK) : 0;
+
     // Render board
     for(int y = 0; y < 8; ++y)
     {
@@ -629,6 +655,11 @@ interface_render(Chess_Interface interf, Hobatch_Context* ctx, Game* game)
             if(!game->last_move.start && game->last_move.to_x == get_x(x, chess->inverted_board) && game->last_move.to_y == get_y(y, chess->inverted_board))
                 color = gm_vec4_add(gm_vec4_scalar_product(0.6f, color), (vec4){0.3f, 0.3f, 0.1f, 0.0f});
 
+            if(threats & (1ULL << (get_y(y, chess->inverted_board) * 8 + get_x(x, chess->inverted_board))))
+                color = gm_vec4_add(gm_vec4_scalar_product(0.7f, color), (vec4){0.3f, 0.05f, 0.05f, 0.0f});
+            if(hanging & (1ULL << (get_y(y, chess->inverted_board) * 8 + get_x(x, chess->inverted_board))))
+                color = gm_vec4_add(gm_vec4_scalar_product(0.5f, color), (vec4){0.45f, 0.25f, 0.0f, 0.0f});
+
             if(chess->premove) {
                 if(!chess->premove_move.start && chess->premove_move.from_x == get_x(x, chess->inverted_board) && chess->premove_move.from_y == get_y(y, chess->inverted_board))
                     color = gm_vec4_add(gm_vec4_scalar_product(0.2f, color), (vec4){0.4f, 0.2f, 0.1f, 0.0f});
@@ -642,7 +673,7 @@ interface_render(Chess_Interface interf, Hobatch_Context* ctx, Game* game)
             if(!(piece_selected != CHESS_NONE && input->start_x == x && input->start_y == y))
             {
                 u32 texture = 0;
-                bool render_piece = texture_from_piece(chess, game->board[get_y(y, chess->inverted_board)][get_x(x, chess->inverted_board)], &texture);
+                bool render_piece = texture_from_piece(chess, game->pos.board[get_y(y, chess->inverted_board)][get_x(x, chess->inverted_board)], &texture);
                 if (render_piece)
                     batch_render_quad_textured(ctx, (vec3){w * x, h * y, 0}, w, h, texture);
             }
@@ -651,14 +682,13 @@ interface_render(Chess_Interface interf, Hobatch_Context* ctx, Game* game)
 
     // Render possible move preview
     if (piece_selected != CHESS_NONE || (input->selected)) {
-        Gen_Moves moves = {0};
+        Gen_Moves moves;
         s32 count_moves = generate_all_valid_moves_from_square(game, &moves, get_x(input->start_x, chess->inverted_board), get_y(input->start_y, chess->inverted_board));
         if(count_moves > 0) {
             for(s32 i = 0; i < count_moves; ++i) {                
-                batch_render_quad_textured(ctx, (vec3){w * get_x(moves.move[i].to_x, chess->inverted_board), h * get_y(moves.move[i].to_y, chess->inverted_board), 0}, w, h, chess->select_dot);
+                batch_render_quad_textured(ctx, (vec3){w * get_x(CHESS_MOVE_TO(moves.move[i]) % 8, chess->inverted_board), h * get_y(CHESS_MOVE_TO(moves.move[i]) / 8, chess->inverted_board), 0}, w, h, chess->select_dot);
             }
         }
-        array_free(moves.move);
     }
 
     interface_render_clock(chess, ctx, game);
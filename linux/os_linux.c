@@ -0,0 +1,57 @@
+#define _POSIX_C_SOURCE 200809L
+#include "os.h"
+#include <stdarg.h>
+#include <time.h>
+#include <sys/stat.h>
+
+// Platform part of os.h for the headless Linux builds, the file helpers are in
+// os_file.c. There is no window, so the window calls only report to stderr.
+
+r64
+os_time_us()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (r64)now.tv_sec * 1000000.0 + (r64)now.tv_nsec / 1000.0;
+}
+
+void
+os_usleep(u64 microseconds)
+{
+    struct timespec duration;
+    duration.tv_sec = (time_t)(microseconds / 1000000);
+    duration.tv_nsec = (long)(microseconds % 1000000) * 1000;
+    nanosleep(&duration, 0);
+}
+
+u64
+os_file_last_modified(const char* filename)
+{
+    struct stat info;
+    if (stat(filename, &info) != 0)
+        return 0;
+    return (u64)info.st_mtime;
+}
+
+u64
+os_timestamp()
+{
+    return 0;
+}
+
+void
+os_toggle_fullscreen()
+{
+}
+
+int
+os_warning(const char* title, const char* fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    fprintf(stderr, "%s: ", title);
+    vfprintf(stderr, fmt, args);
+    fprintf(stderr, "\n");
+    va_end(args);
+    return 0;
+}
@@ -0,0 +1,339 @@
+#include "types.h"
+#include "game.h"
+#include "bitboard.h"
+#include "movebatch.h"
+#include <stdlib.h>
+#include <string.h>
+
+// The vector kernels are x86-64 only, define BATCH_NO_SIMD to always count in scalar
+#if !defined(BATCH_NO_SIMD) && (defined(_M_X64) || defined(__x86_64__))
+#define BATCH_HAS_SIMD
+#include <immintrin.h>
+#if !defined(_MSC_VER)
+#include <cpuid.h>
+#endif
+#endif
+
+#define KERNEL_CAT_(NAME, SUFFIX) NAME##_##SUFFIX
+#define KERNEL_CAT(NAME, SUFFIX) KERNEL_CAT_(NAME, SUFFIX)
+#define KFN(NAME) KERNEL_CAT(NAME, KERNEL_SUFFIX)
+
+// Scalar kernel, one position at a time. Also the reference for the vector ones.
+#define VEC u64
+#define KERNEL_LANES 1
+#define KERNEL_SUFFIX scalar
+#define V_LOAD(P) (*(P))
+#define V_STORE(P, V) (*(P) = (V))
+#define V_SET1(X) ((u64)(X))
+#define V_AND(A, B) ((A) & (B))
+#define V_OR(A, B) ((A) | (B))
+#define V_ANDNOT(A, B) (~(A) & (B))
+#define V_SHL(V, N) ((V) << (N))
+#define V_SHR(V, N) ((V) >> (N))
+#define V_ADD(A, B) ((A) + (B))
+#define V_POPCOUNT(V) ((u64)bb_popcount(V))
+#include "movebatch_kernel.h"
+#undef VEC
+#undef KERNEL_LANES
+#undef KERNEL_SUFFIX
+#undef V_LOAD
+#undef V_STORE
+#undef V_SET1
+#undef V_AND
+#undef V_OR
+#undef V_ANDNOT
+#undef V_SHL
+#undef V_SHR
+#undef V_ADD
+#undef V_POPCOUNT
+
+#if defined(BATCH_HAS_SIMD)
+
+// GCC and clang only emit AVX instructions in functions built for them, MSVC
+// emits intrinsics wherever they are used
+#if defined(__clang__)
+#define BATCH_TARGET_AVX2 _Pragma("clang attribute push(__attribute__((target(\"avx2\"))), apply_to = function)")
+#define BATCH_TARGET_AVX512 _Pragma("clang attribute push(__attribute__((target(\"avx512f,avx512bw\"))), apply_to = function)")
+#define BATCH_TARGET_END _Pragma("clang attribute pop")
+#elif defined(__GNUC__)
+#define BATCH_TARGET_AVX2 _Pragma("GCC push_options") _Pragma("GCC target(\"avx2\")")
+#define BATCH_TARGET_AVX512 _Pragma("GCC push_options") _Pragma("GCC target(\"avx512f,avx512bw\")")
+#define BATCH_TARGET_END _Pragma("GCC pop_options")
+#else
+#define BATCH_TARGET_AVX2
+#define BATCH_TARGET_AVX512
+#define BATCH_TARGET_END
+#endif
+
+BATCH_TARGET_AVX2
+
+// Popcount of each 64 bit lane, nibbles looked up with a shuffle and summed per lane
+static inline __m256i
+popcount_avx2(__m256i v)
+{
+    __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                      0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    __m256i low_mask = _mm256_set1_epi8(0x0f);
+    __m256i low = _mm256_and_si256(v, low_mask);
+    __m256i high = _mm256_and_si256(_mm256_srli_epi16(v, 4), low_mask);
+    __m256i bytes = _mm256_add_epi8(_mm256_shuffle_epi8(lookup, low), _mm256_shuffle_epi8(lookup, high));
+    return _mm256_sad_epu8(bytes, _mm256_setzero_si256());
+}
+
+#define VEC __m256i
+#define KERNEL_LANES 4
+#define KERNEL_SUFFIX avx2
+#define V_LOAD(P) _mm256_loadu_si256((const __m256i*)(P))
+#define V_STORE(P, V) _mm256_storeu_si256((__m256i*)(P), V)
+#define V_SET1(X) _mm256_set1_epi64x((long long)(X))
+#define V_AND(A, B) _mm256_and_si256(A, B)
+#define V_OR(A, B) _mm256_or_si256(A, B)
+#define V_ANDNOT(A, B) _mm256_andnot_si256(A, B)
+#define V_SHL(V, N) _mm256_slli_epi64(V, N)
+#define V_SHR(V, N) _mm256_srli_epi64(V, N)
+#define V_ADD(A, B) _mm256_add_epi64(A, B)
+#define V_POPCOUNT(V) popcount_avx2(V)
+#include "movebatch_kernel.h"
+#undef VEC
+#undef KERNEL_LANES
+#undef KERNEL_SUFFIX
+#undef V_LOAD
+#undef V_STORE
+#undef V_SET1
+#undef V_AND
+#undef V_OR
+#undef V_ANDNOT
+#undef V_SHL
+#undef V_SHR
+#undef V_ADD
+#undef V_POPCOUNT
+
+BATCH_TARGET_END
+
+BATCH_TARGET_AVX512
+
+static inline __m512i
+popcount_avx512(__m512i v)
+{
+    __m512i lookup = _mm512_broadcast_i32x4(_mm_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4));
+    __m512i low_mask = _mm512_set1_epi8(0x0f);
+    __m512i low = _mm512_and_si512(v, low_mask);
+    __m512i high = _mm512_and_si512(_mm512_srli_epi16(v, 4), low_mask);
+    __m512i bytes = _mm512_add_epi8(_mm512_shuffle_epi8(lookup, low), _mm512_shuffle_epi8(lookup, high));
+    return _mm512_sad_epu8(bytes, _mm512_setzero_si512());
+}
+
+#define VEC __m512i
+#define KERNEL_LANES 8
+#define KERNEL_SUFFIX avx512
+#define V_LOAD(P) _mm512_loadu_si512((const void*)(P))
+#define V_STORE(P, V) _mm512_storeu_si512((void*)(P), V)
+#define V_SET1(X) _mm512_set1_epi64((long long)(X))
+#define V_AND(A, B) _mm512_and_si512(A, B)
+#define V_OR(A, B) _mm512_or_si512(A, B)
+#define V_ANDNOT(A, B) _mm512_andnot_si512(A, B)
+#define V_SHL(V, N) _mm512_slli_epi64(V, N)
+#define V_SHR(V, N) _mm512_srli_epi64(V, N)
+#define V_ADD(A, B) _mm512_add_epi64(A, B)
+#define V_POPCOUNT(V) popcount_avx512(V)
+#include "movebatch_kernel.h"
+#undef VEC
+#undef KERNEL_LANES
+#undef KERNEL_SUFFIX
+#undef V_LOAD
+#undef V_STORE
+#undef V_SET1
+#undef V_AND
+#undef V_OR
+#undef V_ANDNOT
+#undef V_SHL
+#undef V_SHR
+#undef V_ADD
+#undef V_POPCOUNT
+
+BATCH_TARGET_END
+
+#endif // BATCH_HAS_SIMD
+
+// Widest vector kernel the cpu and the operating system both support
+Batch_Kernel
+batch_kernel_detect()
+{
+#if defined(BATCH_HAS_SIMD)
+    u32 regs[4] = {0};
+#if defined(_MSC_VER)
+    __cpuid((int*)regs, 0);
+    if(regs[0] < 7)
+        return BATCH_KERNEL_SCALAR;
+    __cpuid((int*)regs, 1);
+#else
+    if(!__get_cpuid(1, &regs[0], &regs[1], &regs[2], &regs[3]))
+        return BATCH_KERNEL_SCALAR;
+#endif
+    // The OS has to save the wide registers, checked through XGETBV
+    if(!(regs[2] & (1 << 27)))
+        return BATCH_KERNEL_SCALAR;
+#if defined(_MSC_VER)
+    u64 xcr0 = _xgetbv(0);
+    __cpuidex((int*)regs, 7, 0);
+#else
+    u32 xcr0_low, xcr0_high;
+    __asm__("xgetbv" : "=a"(xcr0_low), "=d"(xcr0_high) : "c"(0));
+    u64 xcr0 = ((u64)xcr0_high << 32) | xcr0_low;
+    if(!__get_cpuid_count(7, 0, &regs[0], &regs[1], &regs[2], &regs[3]))
+        return BATCH_KERNEL_SCALAR;
+#endif
+    bool avx_state = (xcr0 & 0x06) == 0x06;
+    bool avx512_state = (xcr0 & 0xe6) == 0xe6;
+    if(avx512_state && (regs[1] & (1 << 16)) && (regs[1] & (1 << 30)))
+        return BATCH_KERNEL_AVX512;
+    if(avx_state && (regs[1] & (1 << 5)))
+        return BATCH_KERNEL_AVX2;
+#endif
+    return BATCH_KERNEL_SCALAR;
+}
+
+const char*
+batch_kernel_name(Batch_Kernel kernel)
+{
+    switch(kernel) {
+        case BATCH_KERNEL_AVX2:   return "avx2";
+        case BATCH_KERNEL_AVX512: return "avx512";
+        default:                  return "scalar";
+    }
+}
+
+// Vertical mirror, rank 1 becomes rank 8
+static u64
+mirror(u64 bb)
+{
+#if defined(_MSC_VER)
+    return _byteswap_uint64(bb);
+#else
+    return __builtin_bswap64(bb);
+#endif
+}
+
+static Chess_Piece
+other_color_piece(Chess_Piece piece)
+{
+    return (piece < CHESS_BLACK_KING) ? piece + (CHESS_BLACK_KING - CHESS_WHITE_KING) : piece - (CHESS_BLACK_KING - CHESS_WHITE_KING);
+}
+
+// Capacity is rounded up to the widest kernel so every vector load stays in bounds
+void
+chess_batch_init(Chess_Batch* batch, s32 capacity)
+{
+    memset(batch, 0, sizeof(*batch));
+    batch->capacity = (capacity + 7) & ~7;
+    batch->kernel = batch_kernel_detect();
+    for(s32 p = CHESS_WHITE_KING; p < CHESS_COUNT; ++p)
+        batch->piece[p] = calloc(batch->capacity, sizeof(u64));
+    batch->en_passant_square = calloc(batch->capacity, sizeof(s8));
+    batch->castle_rights = calloc(batch->capacity, sizeof(u8));
+    batch->mirrored = calloc(batch->capacity, sizeof(u8));
+}
+
+void
+chess_batch_free(Chess_Batch* batch)
+{
+    for(s32 p = CHESS_WHITE_KING; p < CHESS_COUNT; ++p)
+        free(batch->piece[p]);
+    free(batch->en_passant_square);
+    free(batch->castle_rights);
+    free(batch->mirrored);
+    memset(batch, 0, sizeof(*batch));
+}
+
+// Copies a position into the next slot, returns its index or -1 when the batch is full
+s32
+chess_batch_add(Chess_Batch* batch, Game* game)
+{
+    if(batch->count >= batch->capacity)
+        return -1;
+
+    s32 index = batch->count++;
+    bool mirrored = !game->pos.white_turn;
+    for(s32 p = CHESS_WHITE_KING; p < CHESS_COUNT; ++p) {
+        u64 bb = game->pos.bb.piece[p];
+        batch->piece[(mirrored) ? other_color_piece(p) : p][index] = (mirrored) ? mirror(bb) : bb;
+    }
+
+    batch->castle_rights[index] = (mirrored) ?
+        (game->pos.black_short_castle_valid | (game->pos.black_long_castle_valid << 1)) :
+        (game->pos.white_short_castle_valid | (game->pos.white_long_castle_valid << 1));
+
+    // Only kept when a pawn can take there, most en passant squares can't matter
+    s32 ep = game->pos.en_passant_square;
+    if(ep >= 0 && mirrored)
+        ep ^= 56;
+    if(ep >= 0 && !(bb_pawn_attacks[CHESS_COLOR_BLACK][ep] & batch->piece[CHESS_WHITE_PAWN][index]))
+        ep = -1;
+    batch->en_passant_square[index] = (s8)ep;
+    batch->mirrored[index] = mirrored;
+    return index;
+}
+
+// Rebuilds the position of a slot in its original orientation
+static void
+batch_game(Chess_Batch* batch, s32 index, Game* game)
+{
+    memset(game, 0, sizeof(*game));
+    bool mirrored = batch->mirrored[index];
+    for(s32 p = CHESS_WHITE_KING; p < CHESS_COUNT; ++p) {
+        u64 bb = batch->piece[p][index];
+        Chess_Piece piece = p;
+        if(mirrored) {
+            bb = mirror(bb);
+            piece = other_color_piece(p);
+        }
+        while(bb) {
+            s32 square = bb_pop_lsb(&bb);
+            game->pos.board[square / 8][square % 8] = piece;
+        }
+    }
+
+    u8 rights = batch->castle_rights[index];
+    game->pos.white_turn = !mirrored;
+    if(mirrored) {
+        game->pos.black_short_castle_valid = (rights & 1) != 0;
+        game->pos.black_long_castle_valid = (rights & 2) != 0;
+    } else {
+        game->pos.white_short_castle_valid = (rights & 1) != 0;
+        game->pos.white_long_castle_valid = (rights & 2) != 0;
+    }
+
+    s32 ep = batch->en_passant_square[index];
+    game->pos.en_passant_square = (ep >= 0 && mirrored) ? (ep ^ 56) : ep;
+    game_sync_bitboards(game);
+}
+
+// Legal move count of every position, counts holds batch->count entries.
+// Positions the kernel can't count exactly go through the scalar generator.
+void
+chess_batch_count(Chess_Batch* batch, s32* counts)
+{
+    switch(batch->kernel) {
+#if defined(BATCH_HAS_SIMD)
+        case BATCH_KERNEL_AVX512: batch_count_avx512(batch, counts); break;
+        case BATCH_KERNEL_AVX2:   batch_count_avx2(batch, counts); break;
+#endif
+        default:                  batch_count_scalar(batch, counts); break;
+    }
+
+    for(s32 i = 0; i < batch->count; ++i) {
+        if(counts[i] < 0) {
+            Gen_Moves moves;
+            counts[i] = chess_batch_generate(batch, i, &moves);
+        }
+    }
+}
+
+// Legal moves of one position, squares are those of the original orientation
+s32
+chess_batch_generate(Chess_Batch* batch, s32 index, Gen_Moves* moves)
+{
+    Game game;
+    batch_game(batch, index, &game);
+    return generate_possible_moves(&game, moves);
+}
@@ -0,0 +1,34 @@
+#pragma once
+#include "types.h"
+#include "game.h"
+
+// Instruction set the batch kernels run on, see batch_kernel_detect
+typedef enum {
+    BATCH_KERNEL_SCALAR = 0,
+    BATCH_KERNEL_AVX2,      // 4 positions per instruction
+    BATCH_KERNEL_AVX512,    // 8 positions per instruction, needs AVX-512F and BW
+} Batch_Kernel;
+
+// Many independent positions in structure of arrays layout, piece[p][i] is the
+// bitboard of piece p in position i. Positions are stored from the side to move,
+// a position with black to move is mirrored vertically and its colors swapped,
+// so the kernels only ever generate for white.
+typedef struct {
+    s32 count;
+    s32 capacity;               // rounded up to whole vectors, lanes past count are loaded but
+                                // their results dropped, their contents are undefined
+    Batch_Kernel kernel;        // best one the cpu supports, may be lowered by the caller
+    u64* piece[CHESS_COUNT];    // piece[CHESS_NONE] is unused
+    s8*  en_passant_square;     // -1 unless a pawn can actually capture there
+    u8*  castle_rights;         // bit 0 short, bit 1 long, of the side to move only
+    u8*  mirrored;              // black to move in the original position
+} Chess_Batch;
+
+Batch_Kernel batch_kernel_detect();
+const char*  batch_kernel_name(Batch_Kernel kernel);
+
+void chess_batch_init(Chess_Batch* batch, s32 capacity);
+void chess_batch_free(Chess_Batch* batch);
+s32  chess_batch_add(Chess_Batch* batch, Game* game);
+void chess_batch_count(Chess_Batch* batch, s32* counts);
+s32  chess_batch_generate(Chess_Batch* batch, s32 index, Gen_Moves* moves);
@@ -0,0 +1,157 @@
+// Move counting kernel of movebatch.c, included once per instruction set with
+// VEC, the V_ operations, KERNEL_LANES and KFN defined. No include guard on purpose.
+//
+// Every piece set is moved a whole direction at a time. The rays of one side's
+// sliders in a single direction never overlap, and shifting a knight or pawn set
+// is one to one, so popcounts of the shifted sets are exact move counts.
+
+static inline VEC
+KFN(shift)(VEC v, s32 s, u64 mask)
+{
+    VEC shifted = (s > 0) ? V_SHL(v, s) : V_SHR(v, -s);
+    return V_AND(shifted, V_SET1(mask));
+}
+
+// Attacks of every slider in gen along one direction, stops on the first blocker
+static inline VEC
+KFN(slide)(VEC gen, VEC empty, s32 s, u64 mask)
+{
+    VEC open = V_AND(empty, V_SET1(mask));
+    for (s32 i = 0; i < 6; ++i)
+        gen = V_OR(gen, V_AND(KFN(shift)(gen, s, mask), open));
+    return KFN(shift)(gen, s, mask);
+}
+
+static inline VEC
+KFN(knight_set)(VEC n)
+{
+    VEC result = KFN(shift)(n, 17, ~BB_FILE_A);
+    result = V_OR(result, KFN(shift)(n, 15, ~BB_FILE_H));
+    result = V_OR(result, KFN(shift)(n, 10, ~(BB_FILE_A | BB_FILE_A << 1)));
+    result = V_OR(result, KFN(shift)(n, 6, ~(BB_FILE_H | BB_FILE_H >> 1)));
+    result = V_OR(result, KFN(shift)(n, -6, ~(BB_FILE_A | BB_FILE_A << 1)));
+    result = V_OR(result, KFN(shift)(n, -10, ~(BB_FILE_H | BB_FILE_H >> 1)));
+    result = V_OR(result, KFN(shift)(n, -15, ~BB_FILE_A));
+    return V_OR(result, KFN(shift)(n, -17, ~BB_FILE_H));
+}
+
+static inline VEC
+KFN(king_set)(VEC k)
+{
+    VEC row = V_OR(k, V_OR(KFN(shift)(k, 1, ~BB_FILE_A), KFN(shift)(k, -1, ~BB_FILE_H)));
+    VEC block = V_OR(row, V_OR(KFN(shift)(row, 8, ~0ULL), KFN(shift)(row, -8, ~0ULL)));
+    return V_ANDNOT(k, block);
+}
+
+// Legal move counts of positions [0, batch->count), -1 for the ones the kernel
+// leaves to the scalar generator: in check, with a pin, with a possible en passant
+// capture or without a king
+static void
+KFN(batch_count)(Chess_Batch* batch, s32* counts)
+{
+    static const s32 rook_shift[4] = { 8, -8, 1, -1 };
+    static const u64 rook_mask[4] = { ~0ULL, ~0ULL, ~BB_FILE_A, ~BB_FILE_H };
+    static const s32 bishop_shift[4] = { 9, 7, -7, -9 };
+    static const u64 bishop_mask[4] = { ~BB_FILE_A, ~BB_FILE_H, ~BB_FILE_A, ~BB_FILE_H };
+    static const s32 knight_shift[8] = { 17, 15, 10, 6, -6, -10, -15, -17 };
+    static const u64 knight_mask[8] = {
+        ~BB_FILE_A, ~BB_FILE_H, ~(BB_FILE_A | BB_FILE_A << 1), ~(BB_FILE_H | BB_FILE_H >> 1),
+        ~(BB_FILE_A | BB_FILE_A << 1), ~(BB_FILE_H | BB_FILE_H >> 1), ~BB_FILE_A, ~BB_FILE_H,
+    };
+
+    u64 lane_count[KERNEL_LANES];
+    u64 lane_trouble[KERNEL_LANES];
+    u64 lane_occupancy[KERNEL_LANES];
+    u64 lane_danger[KERNEL_LANES];
+
+    for (s32 base = 0; base < batch->count; base += KERNEL_LANES) {
+        VEC king   = V_LOAD(&batch->piece[CHESS_WHITE_KING][base]);
+        VEC queens = V_LOAD(&batch->piece[CHESS_WHITE_QUEEN][base]);
+        VEC rooks  = V_OR(V_LOAD(&batch->piece[CHESS_WHITE_ROOK][base]), queens);
+        VEC knights = V_LOAD(&batch->piece[CHESS_WHITE_KNIGHT][base]);
+        VEC bishops = V_OR(V_LOAD(&batch->piece[CHESS_WHITE_BISHOP][base]), queens);
+        VEC pawns  = V_LOAD(&batch->piece[CHESS_WHITE_PAWN][base]);
+
+        VEC their_king   = V_LOAD(&batch->piece[CHESS_BLACK_KING][base]);
+        VEC their_queens = V_LOAD(&batch->piece[CHESS_BLACK_QUEEN][base]);
+        VEC their_rooks  = V_OR(V_LOAD(&batch->piece[CHESS_BLACK_ROOK][base]), their_queens);
+        VEC their_knights = V_LOAD(&batch->piece[CHESS_BLACK_KNIGHT][base]);
+        VEC their_bishops = V_OR(V_LOAD(&batch->piece[CHESS_BLACK_BISHOP][base]), their_queens);
+        VEC their_pawns  = V_LOAD(&batch->piece[CHESS_BLACK_PAWN][base]);
+
+        VEC own = V_OR(V_OR(king, rooks), V_OR(V_OR(knights, bishops), pawns));
+        VEC their = V_OR(V_OR(their_king, their_rooks), V_OR(V_OR(their_knights, their_bishops), their_pawns));
+        VEC occupancy = V_OR(own, their);
+        VEC empty = V_ANDNOT(occupancy, V_SET1(~0ULL));
+        VEC targets = V_ANDNOT(own, V_SET1(~0ULL));
+
+        // Squares the enemy attacks, our king is taken off so it can't hide behind itself
+        VEC empty_no_king = V_OR(empty, king);
+        VEC danger = V_OR(KFN(shift)(their_pawns, -7, ~BB_FILE_A), KFN(shift)(their_pawns, -9, ~BB_FILE_H));
+        danger = V_OR(danger, KFN(knight_set)(their_knights));
+        danger = V_OR(danger, KFN(king_set)(their_king));
+
+        for (s32 d = 0; d < 4; ++d) {
+            danger = V_OR(danger, KFN(slide)(their_rooks, empty_no_king, rook_shift[d], rook_mask[d]));
+            danger = V_OR(danger, KFN(slide)(their_bishops, empty_no_king, bishop_shift[d], bishop_mask[d]));
+        }
+
+        // Checkers and pins, looking out from the king in every direction
+        VEC trouble = V_AND(V_OR(KFN(shift)(king, 7, ~BB_FILE_H), KFN(shift)(king, 9, ~BB_FILE_A)), their_pawns);
+        trouble = V_OR(trouble, V_AND(KFN(knight_set)(king), their_knights));
+
+        VEC count = V_POPCOUNT(V_ANDNOT(danger, V_AND(KFN(king_set)(king), targets)));
+        for (s32 d = 0; d < 4; ++d) {
+            VEC ray = KFN(slide)(king, empty, rook_shift[d], rook_mask[d]);
+            VEC beyond = KFN(slide)(V_AND(ray, own), empty, rook_shift[d], rook_mask[d]);
+            trouble = V_OR(trouble, V_AND(V_OR(ray, beyond), their_rooks));
+            ray = KFN(slide)(king, empty, bishop_shift[d], bishop_mask[d]);
+            beyond = KFN(slide)(V_AND(ray, own), empty, bishop_shift[d], bishop_mask[d]);
+            trouble = V_OR(trouble, V_AND(V_OR(ray, beyond), their_bishops));
+
+            count = V_ADD(count, V_POPCOUNT(V_AND(KFN(slide)(rooks, empty, rook_shift[d], rook_mask[d]), targets)));
+            count = V_ADD(count, V_POPCOUNT(V_AND(KFN(slide)(bishops, empty, bishop_shift[d], bishop_mask[d]), targets)));
+        }
+
+        for (s32 d = 0; d < 8; ++d)
+            count = V_ADD(count, V_POPCOUNT(V_AND(KFN(shift)(knights, knight_shift[d], knight_mask[d]), targets)));
+
+        // Pawns, a promotion is four moves
+        VEC push = V_AND(KFN(shift)(pawns, 8, ~0ULL), empty);
+        VEC double_push = V_AND(KFN(shift)(V_AND(push, V_SET1(BB_RANK_1 << 16)), 8, ~0ULL), empty);
+        VEC capture_west = V_AND(KFN(shift)(pawns, 7, ~BB_FILE_H), their);
+        VEC capture_east = V_AND(KFN(shift)(pawns, 9, ~BB_FILE_A), their);
+        VEC last_rank = V_SET1(BB_RANK_8);
+        count = V_ADD(count, V_ADD(V_POPCOUNT(push), V_POPCOUNT(double_push)));
+        count = V_ADD(count, V_ADD(V_POPCOUNT(capture_west), V_POPCOUNT(capture_east)));
+        VEC promotions = V_ADD(V_POPCOUNT(V_AND(push, last_rank)),
+            V_ADD(V_POPCOUNT(V_AND(capture_west, last_rank)), V_POPCOUNT(V_AND(capture_east, last_rank))));
+        count = V_ADD(count, V_ADD(promotions, V_ADD(promotions, promotions)));
+
+        V_STORE(lane_count, count);
+        V_STORE(lane_trouble, trouble);
+        V_STORE(lane_occupancy, occupancy);
+        V_STORE(lane_danger, danger);
+
+        for (s32 lane = 0; lane < KERNEL_LANES && base + lane < batch->count; ++lane) {
+            s32 i = base + lane;
+            if (lane_trouble[lane] || !batch->piece[CHESS_WHITE_KING][i] || batch->en_passant_square[i] >= 0) {
+                counts[i] = -1;
+                continue;
+            }
+
+            s32 result = (s32)lane_count[lane];
+
+            // Castling, the king is on e1 and not in check or the lane would be in trouble
+            u64 own_rooks = batch->piece[CHESS_WHITE_ROOK][i];
+            u8 rights = batch->castle_rights[i];
+            if (batch->piece[CHESS_WHITE_KING][i] == (1ULL << 4)) {
+                if ((rights & 1) && (own_rooks & (1ULL << 7)) && !(lane_occupancy[lane] & 0x60) && !(lane_danger[lane] & 0x60))
+                    result++;
+                if ((rights & 2) && (own_rooks & 1ULL) && !(lane_occupancy[lane] & 0x0e) && !(lane_danger[lane] & 0x0c))
+                    result++;
+            }
+            counts[i] = result;
+        }
+    }
+}
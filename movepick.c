@@ -0,0 +1,169 @@
+#include "types.h"
+#include "game.h"
+#include "movepick.h"
+#include "see.h"
+
+// Ordering values by piece kind, king, queen, rook, knight, bishop, pawn. The king
+// is only ever an attacker and goes last.
+static const s32 pick_value[6] = { 100, 9, 5, 3, 3, 1 };
+
+static s32
+piece_kind(Chess_Piece piece)
+{
+    return (piece - CHESS_WHITE_KING) % (CHESS_BLACK_KING - CHESS_WHITE_KING);
+}
+
+// Captures and promotions, the moves the capture stage hands out
+bool
+move_is_tactical(Game* game, Chess_Packed_Move move)
+{
+    s32 to = CHESS_MOVE_TO(move);
+    s32 flag = CHESS_MOVE_FLAG(move);
+    return flag == CHESS_MOVE_PROMOTION || flag == CHESS_MOVE_EN_PASSANT ||
+        (flag == CHESS_MOVE_NORMAL && game->pos.board[to / 8][to % 8] != CHESS_NONE);
+}
+
+// Most valuable victim first, least valuable attacker breaks ties, promotions
+// add the piece they become
+static s32
+mvv_lva(Game* game, Chess_Packed_Move move)
+{
+    s32 from = CHESS_MOVE_FROM(move);
+    s32 to = CHESS_MOVE_TO(move);
+    Chess_Piece attacker = game->pos.board[from / 8][from % 8];
+    Chess_Piece victim = game->pos.board[to / 8][to % 8];
+
+    s32 score = -pick_value[piece_kind(attacker)];
+    if (CHESS_MOVE_FLAG(move) == CHESS_MOVE_EN_PASSANT)
+        score += 64 * pick_value[piece_kind(CHESS_WHITE_PAWN)];
+    else if (victim != CHESS_NONE)
+        score += 64 * pick_value[piece_kind(victim)];
+    if (CHESS_MOVE_FLAG(move) == CHESS_MOVE_PROMOTION) {
+        static const s32 promotion_kind[4] = { 3, 4, 2, 1 }; // indexed by Chess_Promotion
+        score += 64 * pick_value[promotion_kind[CHESS_MOVE_PROMOTION(move)]];
+    }
+    return score;
+}
+
+// Only a capture of something worth less than the capturing piece can lose
+// material, the others don't need an exchange evaluation. The king is never
+// recaptured, its captures are legal.
+static bool
+capture_may_lose(Game* game, Chess_Packed_Move move)
+{
+    if (CHESS_MOVE_FLAG(move) != CHESS_MOVE_NORMAL)
+        return false;
+    s32 from = CHESS_MOVE_FROM(move);
+    s32 to = CHESS_MOVE_TO(move);
+    s32 attacker = piece_kind(game->pos.board[from / 8][from % 8]);
+    s32 victim = piece_kind(game->pos.board[to / 8][to % 8]);
+    return attacker != 0 && pick_value[victim] < pick_value[attacker];
+}
+
+// A hash move can come from another position with the same key, it is only
+// played when the legal generator produces it too
+static bool
+hash_move_legal(Game* game, Chess_Packed_Move move)
+{
+    Gen_Moves moves;
+    s32 from = CHESS_MOVE_FROM(move);
+    generate_possible_moves_from_square(game, &moves, from % 8, from / 8);
+    for (s32 i = 0; i < moves.count; ++i) {
+        if (moves.move[i] == move)
+            return true;
+    }
+    return false;
+}
+
+void
+move_picker_init(Move_Picker* picker, Game* game, Chess_Packed_Move hash_move, bool captures_only)
+{
+    picker->stage = PICK_HASH_MOVE;
+    picker->captures_only = captures_only;
+    picker->index = 0;
+    picker->moves.count = 0;
+    picker->bad_count = 0;
+    picker->bad_index = 0;
+
+    if (hash_move != CHESS_MOVE_NONE && captures_only && !move_is_tactical(game, hash_move))
+        hash_move = CHESS_MOVE_NONE;
+    if (hash_move != CHESS_MOVE_NONE && !hash_move_legal(game, hash_move))
+        hash_move = CHESS_MOVE_NONE;
+    picker->hash_move = hash_move;
+}
+
+// Next move to try, CHESS_MOVE_NONE once every stage is exhausted.
+// The game must be in the same position as when the picker was initialized.
+Chess_Packed_Move
+move_picker_next(Move_Picker* picker, Game* game)
+{
+    for (;;) {
+        switch (picker->stage) {
+            case PICK_HASH_MOVE: {
+                picker->stage = PICK_GENERATE_CAPTURES;
+                if (picker->hash_move != CHESS_MOVE_NONE)
+                    return picker->hash_move;
+            } break;
+
+            case PICK_GENERATE_CAPTURES: {
+                generate_captures(game, &picker->moves);
+                for (s32 i = 0; i < picker->moves.count; ++i)
+                    picker->score[i] = mvv_lva(game, picker->moves.move[i]);
+                picker->stage = PICK_CAPTURES;
+            } break;
+
+            case PICK_CAPTURES: {
+                if (picker->index >= picker->moves.count) {
+                    picker->stage = (picker->captures_only) ? PICK_BAD_CAPTURES : PICK_GENERATE_QUIETS;
+                    break;
+                }
+
+                // Selection of the best remaining capture, most nodes cut off after a few
+                s32 best = picker->index;
+                for (s32 i = best + 1; i < picker->moves.count; ++i) {
+                    if (picker->score[i] > picker->score[best])
+                        best = i;
+                }
+                Chess_Packed_Move move = picker->moves.move[best];
+                picker->moves.move[best] = picker->moves.move[picker->index];
+                picker->score[best] = picker->score[picker->index];
+                picker->index++;
+
+                if (move == picker->hash_move)
+                    break;
+                if (capture_may_lose(game, move) && see_move(&game->pos, move) < 0) {
+                    picker->bad[picker->bad_count++] = move;
+                    break;
+                }
+                return move;
+            } break;
+
+            case PICK_GENERATE_QUIETS: {
+                generate_quiets(game, &picker->moves);
+                picker->stage = PICK_QUIETS;
+            } break;
+
+            case PICK_QUIETS: {
+                if (picker->index >= picker->moves.count) {
+                    picker->stage = PICK_BAD_CAPTURES;
+                    break;
+                }
+                Chess_Packed_Move move = picker->moves.move[picker->index++];
+                if (move != picker->hash_move)
+                    return move;
+            } break;
+
+            case PICK_BAD_CAPTURES: {
+                if (picker->bad_index >= picker->bad_count) {
+                    picker->stage = PICK_DONE;
+                    break;
+                }
+                return picker->bad[picker->bad_index++];
+            }
+
+            case PICK_DONE: {
+                return CHESS_MOVE_NONE;
+            }
+        }
+    }
+}
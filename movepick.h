@@ -0,0 +1,34 @@
+#pragma once
+#include "types.h"
+#include "game.h"
+
+// Stages of Move_Picker, in the order the moves come out
+typedef enum {
+    PICK_HASH_MOVE = 0,
+    PICK_GENERATE_CAPTURES,
+    PICK_CAPTURES,
+    PICK_GENERATE_QUIETS,
+    PICK_QUIETS,
+    PICK_BAD_CAPTURES,
+    PICK_DONE,
+} Pick_Stage;
+
+// Hands out the legal moves of a position one at a time: the hash move first,
+// then captures and promotions by MVV/LVA, then quiet moves, and last the
+// captures that lose material by static exchange. Each stage is only generated
+// when it is reached, so a cutoff skips the work of the later ones.
+typedef struct {
+    Pick_Stage stage;
+    Chess_Packed_Move hash_move;    // CHESS_MOVE_NONE if there is none or it isn't legal
+    bool captures_only;             // stop after the captures, for tactical scans
+    s32 index;                      // next move handed out
+    Gen_Moves moves;                // captures, then the quiet moves appended after them
+    s32 score[MAX_MOVES];
+    s32 bad_count;                  // losing captures put aside until the quiet moves are done
+    s32 bad_index;
+    Chess_Packed_Move bad[MAX_MOVES];
+} Move_Picker;
+
+void move_picker_init(Move_Picker* picker, Game* game, Chess_Packed_Move hash_move, bool captures_only);
+Chess_Packed_Move move_picker_next(Move_Picker* picker, Game* game);
+bool move_is_tactical(Game* game, Chess_Packed_Move move);
@@ -4,146 +4,6 @@
 #include "light_array.h"
 #include <Windows.h>
 
-char*
-os_extensionless_filename(const char* filename)
-{
-    s32 length = (s32)strlen(filename);
-    s32 newlen = 0;
-    for (s32 i = length - 1; i >= 0; --i)
-    {
-        if (filename[i] == '.')
-        {
-            newlen = i;
-            break;
-        }
-    }
-    void* mem = calloc(1, newlen + 1);
-
-    memcpy(mem, filename, newlen);
-    return (char*)mem;
-}
-
-const char*
-os_filename_from_path(const char* path)
-{
-    size_t len = strlen(path);
-    size_t i = len - 1;
-    for (; i >= 0; --i)
-    {
-#if defined (_WIN32) || defined(_WIN64)
-        if (path[i] == '\\') {
-            i++;
-            break;
-        }
-#endif
-        if (path[i] == '/')
-        {
-            i++;
-            break;
-        }
-    }
-    return path + i;
-}
-
-bool
-os_file_exists(const char* path)
-{
-    FILE* f = fopen(path, "r");
-    if (f)
-    {
-        fclose(f);
-        return true;
-    }
-    return false;
-}
-
-char*
-os_file_read(const char* path, s32* file_length, void* (*allocator)(size_t))
-{
-    FILE* file;
-    s8* buffer;
-    s32 len;
-
-    file = fopen(path, "rb");
-    if (file == NULL)
-    {
-        printf("os_file_read: could not open file %s", path);
-        return NULL;
-    }
-
-    fseek(file, 0, SEEK_END);
-    len = ftell(file);
-    rewind(file);
-
-    buffer = (s8*)allocator((len + 1) * sizeof(char));
-    if (fread(buffer, 1, len, file) != len)
-    {
-        printf("os_file_read: could not read file %s", path);
-        fclose(file);
-        free(buffer);
-        return NULL;
-    }
-
-    fclose(file);
-
-    buffer[len] = '\0';
-
-    if (file_length)
-        *file_length = len;
-
-    return buffer;
-}
-
-void
-os_file_free(char* buf)
-{
-    free(buf);
-}
-
-s32
-os_file_write_new(const char* path, const char* buf, s32 size)
-{
-    FILE* fptr;
-    fptr = fopen(path, "wb+");
-    if (fptr == NULL)
-    {
-        printf("os_file_write: could not open file %s", path);
-        return -1;
-    }
-
-    if (fwrite(buf, 1, size, fptr) != size)
-    {
-        printf("os_file_write: could not write to file %s", path);
-        return -1;
-    }
-
-    fclose(fptr);
-
-    return 0;
-}
-
-s32
-os_file_write(const char* path, const char* buf, s32 size)
-{
-    FILE* fptr;
-    fptr = fopen(path, "wb");
-    if (fptr == NULL)
-    {
-        printf("os_file_write: could not open file %s", path);
-        return -1;
-    }
-
-    if (fwrite(buf, 1, size, fptr) != size)
-    {
-        printf("os_file_write: could not write to file %s", path);
-        return -1;
-    }
-
-    fclose(fptr);
-
-    return 0;
-}
-
 static r64 perf_frequency;
 static void
 os_set_query_frequency()
@@ -241,16 +101,3 @@ os_warning(const char* title, const char* fmt, ...)
 
     return length;
 }
-
-bool
-os_copy_file(const char* filename, const char* copy_name)
-{
-    s32 length;
-    char* data = os_file_read(filename, &length, malloc);
-    if (!data)
-        return false;
-
-    if (os_file_write_new(copy_name, data, length) == -1)
-        return false;
-    return true;
-}
\ No newline at end of file
@@ -1,22 +1,11 @@
 #pragma once
 #include <stdio.h>
 #include <stdlib.h>
-#include <windows.h>
-
-typedef long long s64;
-typedef int s32;
-typedef short s16;
-typedef char s8;
-typedef unsigned long long u64;
-typedef unsigned int u32;
-typedef unsigned short u16;
-typedef unsigned char u8;
-typedef double r64;
-typedef float r32;
+#include "types.h"
 
-typedef int bool;
-#define true 1
-#define false 0
+#if defined(_WIN32)
+#include <windows.h>
+#endif
 
 // Files
 bool        os_file_exists(const char* path);
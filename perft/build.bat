@@ -0,0 +1,9 @@
+@echo off
+
+if not exist bin\ (
+    mkdir bin
+)
+
+pushd bin
+cl /nologo /O2 /I../.. /I../../include ../perft.c ../../game.c ../../eval.c ../../fen.c ../../bitboard.c ../../movebatch.c ../../os.c ../../os_file.c /Fe:perft.exe /link user32.lib
+popd
@@ -0,0 +1,619 @@
+// ------------------------------------------------------------------------
+// ------------------------------- Perft ----------------------------------
+//
+// Counts the leaf nodes of the legal move tree of a position, used to validate
+// and benchmark the move generator of game.c.
+//
+//   perft [options] <depth> ["fen"]
+//   perft [options] -suite <file>
+//
+//   -divide        node count of every root move
+//   -nobulk        visit the last ply instead of counting the legal moves
+//   -hash <mb>     cache subtree counts by position and depth
+//   -threads <n>   worker threads, 0 uses every core
+//   -speedup       also run single threaded and report the speedup
+//   -batch         count the last ply with the batch kernels of movebatch.c,
+//                  every kernel the cpu supports, and check each count
+//                  against the legal move generator
+//
+// Suite files hold one position per line as: fen;depth;expected nodes
+
+#include <stdio.h>
+#include <string.h>
+#include <os.h>
+#include <game.h>
+#include <bitboard.h>
+#include <movebatch.h>
+#include <light_array.h>
+
+#if !defined(_WIN32) && !defined(_WIN64)
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#define STARTPOS "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1"
+#define MAX_SPLIT_PLY 4
+#define BATCH_SIZE 4096
+#define MAX_HASH_DEPTH 64
+
+// Shared by every thread without locks. The key is stored xored with the count,
+// so an entry torn by two concurrent writes fails verification instead of
+// returning the wrong count.
+typedef struct {
+    volatile u64 key;
+    volatile u64 nodes;
+} Perft_Entry;
+
+typedef struct {
+    Perft_Entry* entries;
+    u64          mask;
+} Perft_Hash;
+
+// A subtree handed to a worker, reached from the root by playing path
+typedef struct {
+    Chess_Packed_Move path[MAX_SPLIT_PLY];
+    s32        path_length;
+    s32        depth;
+    s32        root_index;
+    u64        nodes;
+} Perft_Work;
+
+typedef struct {
+    Game*        root;
+    Perft_Hash*  hash;
+    Perft_Work*  work;
+    s32          work_count;
+    volatile s32 next_work;
+} Perft_Pool;
+
+typedef struct {
+    Game*       game;   // on the worker's stack, calloc doesn't keep the alignment of Game
+    Perft_Hash* hash;
+    Perft_Pool* pool;
+    u64         hits;
+    u64         probes;
+} Perft_Worker;
+
+typedef struct {
+    u64 nodes;
+    u64 hits;
+    u64 probes;
+    r64 elapsed_us;
+} Perft_Result;
+
+// Positions one ply above the leaves, counted a batch at a time
+typedef struct {
+    Chess_Batch batch;
+    s32*        counts;
+    s32*        expected;   // generate_possible_moves count of every slot
+    u64         nodes;
+    u64         mismatches;
+} Perft_Batch;
+
+static bool bulk_counting = true;
+
+// ------------------------------------------------------------------------
+// Threads
+
+static s32
+atomic_increment(volatile s32* value)
+{
+#if defined(_WIN32) || defined(_WIN64)
+    return InterlockedIncrement((volatile LONG*)value) - 1;
+#else
+    return __sync_fetch_and_add(value, 1);
+#endif
+}
+
+static s32
+cpu_count()
+{
+#if defined(_WIN32) || defined(_WIN64)
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (s32)info.dwNumberOfProcessors;
+#else
+    s32 count = (s32)sysconf(_SC_NPROCESSORS_ONLN);
+    return (count > 0) ? count : 1;
+#endif
+}
+
+// ------------------------------------------------------------------------
+// Position hashing
+
+// The position part of the key is Position.hash, depth is mixed in so counts of
+// the same position at different depths don't collide
+static u64 zobrist_depth[MAX_HASH_DEPTH];
+
+static void
+zobrist_init()
+{
+    u64 state = 0x9E3779B97F4A7C15ULL;
+    for(s32 i = 0; i < MAX_HASH_DEPTH; ++i) {
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        zobrist_depth[i] = state * 2685821657736338717ULL;
+    }
+}
+
+static void
+perft_hash_new(Perft_Hash* hash, s32 megabytes)
+{
+    u64 count = 1;
+    while(count * 2 * sizeof(Perft_Entry) <= (u64)megabytes * 1024 * 1024)
+        count *= 2;
+    hash->entries = calloc(count, sizeof(Perft_Entry));
+    hash->mask = count - 1;
+}
+
+static void
+perft_hash_clear(Perft_Hash* hash)
+{
+    if(hash->entries)
+        memset((void*)hash->entries, 0, (hash->mask + 1) * sizeof(Perft_Entry));
+}
+
+// ------------------------------------------------------------------------
+// Perft
+
+static void
+move_to_string(Chess_Packed_Move move, char* buffer)
+{
+    s32 from = CHESS_MOVE_FROM(move), to = CHESS_MOVE_TO(move);
+    buffer[0] = 'a' + from % 8;
+    buffer[1] = '1' + from / 8;
+    buffer[2] = 'a' + to % 8;
+    buffer[3] = '1' + to / 8;
+    buffer[4] = (CHESS_MOVE_FLAG(move) == CHESS_MOVE_PROMOTION) ? "nbrq"[CHESS_MOVE_PROMOTION(move)] : 0;
+    buffer[5] = 0;
+}
+
+static u64
+perft(Perft_Worker* worker, s32 depth)
+{
+    if(depth == 0)
+        return 1;
+
+    Game* game = worker->game;
+    Perft_Hash* hash = worker->hash;
+    u64 key = 0;
+    bool hashed = (hash && depth > 1 && depth < MAX_HASH_DEPTH);
+    if(hashed) {
+        key = game->pos.hash ^ zobrist_depth[depth];
+        Perft_Entry* entry = &hash->entries[key & hash->mask];
+        u64 nodes = entry->nodes;
+        worker->probes++;
+        if((entry->key ^ nodes) == key) {
+            worker->hits++;
+            return nodes;
+        }
+    }
+
+    Gen_Moves moves;
+    s32 count = generate_possible_moves(game, &moves);
+
+    u64 nodes = 0;
+    if(depth == 1 && bulk_counting) {
+        // Bulk counting, the legal moves are the leaves
+        nodes = count;
+    } else {
+        for(s32 i = 0; i < count; ++i) {
+            Chess_Undo undo;
+            game_make_move(game, moves.move[i], &undo);
+            nodes += perft(worker, depth - 1);
+            game_unmake_move(game, moves.move[i], &undo);
+        }
+    }
+
+    if(hashed) {
+        Perft_Entry* entry = &hash->entries[key & hash->mask];
+        entry->key = key ^ nodes;
+        entry->nodes = nodes;
+    }
+    return nodes;
+}
+
+// Expands the tree from the root down to split_ply, every position reached
+// becomes one work item. Positions without moves before that have no leaves
+// and produce nothing.
+static void
+split_work(Game* game, Perft_Work** work, Perft_Work* current, s32 split_ply)
+{
+    if(current->path_length == split_ply) {
+        array_push(*work, *current);
+        return;
+    }
+
+    Gen_Moves moves;
+    s32 count = generate_possible_moves(game, &moves);
+    for(s32 i = 0; i < count; ++i) {
+        Chess_Undo undo;
+        if(current->path_length == 0)
+            current->root_index = i;
+        current->path[current->path_length++] = moves.move[i];
+        current->depth--;
+        game_make_move(game, moves.move[i], &undo);
+        split_work(game, work, current, split_ply);
+        game_unmake_move(game, moves.move[i], &undo);
+        current->depth++;
+        current->path_length--;
+    }
+}
+
+static void
+perft_worker_run(Perft_Worker* worker)
+{
+    Perft_Pool* pool = worker->pool;
+    Game game;
+    worker->game = &game;
+    for(;;) {
+        s32 index = atomic_increment(&pool->next_work);
+        if(index >= pool->work_count)
+            break;
+
+        Perft_Work* work = &pool->work[index];
+        game = *pool->root;
+        for(s32 i = 0; i < work->path_length; ++i) {
+            Chess_Undo undo;
+            game_make_move(&game, work->path[i], &undo);
+        }
+        work->nodes = perft(worker, work->depth);
+    }
+}
+
+#if defined(_WIN32) || defined(_WIN64)
+static DWORD WINAPI
+perft_thread(void* param)
+{
+    perft_worker_run((Perft_Worker*)param);
+    return 0;
+}
+#else
+static void*
+perft_thread(void* param)
+{
+    perft_worker_run((Perft_Worker*)param);
+    return 0;
+}
+#endif
+
+// Counts the leaves below game with the given number of threads. When
+// root_nodes is not null it receives the count of every root move, in the
+// order of generate_possible_moves.
+static Perft_Result
+perft_run(Game* game, s32 depth, s32 thread_count, Perft_Hash* hash, u64* root_nodes)
+{
+    Perft_Result result = {0};
+    r64 start = os_time_us();
+
+    // Split deep enough that every thread gets several subtrees, so that
+    // uneven subtree sizes even out. One ply is always left to the workers.
+    Perft_Pool pool = {0};
+    pool.root = game;
+    pool.hash = hash;
+    s32 split_ply = 1;
+    for(;;) {
+        Perft_Work current = {0};
+        current.depth = depth;
+        pool.work = array_new(Perft_Work);
+        split_work(game, &pool.work, &current, split_ply);
+        pool.work_count = array_length(pool.work);
+        if(thread_count == 1 || pool.work_count >= thread_count * 16 ||
+           split_ply + 1 >= depth || split_ply == MAX_SPLIT_PLY)
+            break;
+        array_free(pool.work);
+        split_ply++;
+    }
+    Perft_Worker* workers = calloc(thread_count, sizeof(Perft_Worker));
+    for(s32 i = 0; i < thread_count; ++i) {
+        workers[i].hash = hash;
+        workers[i].pool = &pool;
+    }
+
+#if defined(_WIN32) || defined(_WIN64)
+    HANDLE* threads = calloc(thread_count, sizeof(HANDLE));
+    for(s32 i = 1; i < thread_count; ++i)
+        threads[i] = CreateThread(0, 0, perft_thread, &workers[i], 0, 0);
+    perft_worker_run(&workers[0]);
+    for(s32 i = 1; i < thread_count; ++i) {
+        WaitForSingleObject(threads[i], INFINITE);
+        CloseHandle(threads[i]);
+    }
+#else
+    pthread_t* threads = calloc(thread_count, sizeof(pthread_t));
+    for(s32 i = 1; i < thread_count; ++i)
+        pthread_create(&threads[i], NULL, perft_thread, &workers[i]);
+    perft_worker_run(&workers[0]);
+    for(s32 i = 1; i < thread_count; ++i)
+        pthread_join(threads[i], NULL);
+#endif
+    free(threads);
+
+    for(s32 i = 0; i < pool.work_count; ++i) {
+        result.nodes += pool.work[i].nodes;
+        if(root_nodes)
+            root_nodes[pool.work[i].root_index] += pool.work[i].nodes;
+    }
+    for(s32 i = 0; i < thread_count; ++i) {
+        result.hits += workers[i].hits;
+        result.probes += workers[i].probes;
+    }
+    free(workers);
+    array_free(pool.work);
+
+    result.elapsed_us = os_time_us() - start;
+    return result;
+}
+
+// ------------------------------------------------------------------------
+// Batch counting
+
+// Counts the full batch with every kernel from scalar up to the widest one the
+// cpu supports, any count that differs from the generator is reported
+static void
+perft_batch_flush(Perft_Batch* pb)
+{
+    Batch_Kernel widest = batch_kernel_detect();
+    for(s32 kernel = BATCH_KERNEL_SCALAR; kernel <= (s32)widest; ++kernel) {
+        pb->batch.kernel = (Batch_Kernel)kernel;
+        chess_batch_count(&pb->batch, pb->counts);
+        for(s32 i = 0; i < pb->batch.count; ++i) {
+            if(pb->counts[i] != pb->expected[i]) {
+                if(pb->mismatches < 10)
+                    printf("  %s kernel counted %d moves instead of %d\n",
+                        batch_kernel_name(kernel), pb->counts[i], pb->expected[i]);
+                pb->mismatches++;
+            }
+        }
+    }
+    for(s32 i = 0; i < pb->batch.count; ++i)
+        pb->nodes += pb->expected[i];
+    pb->batch.count = 0;
+}
+
+static void
+perft_batch_walk(Perft_Batch* pb, Game* game, s32 depth)
+{
+    if(depth == 1) {
+        if(pb->batch.count == pb->batch.capacity)
+            perft_batch_flush(pb);
+        Gen_Moves moves;
+        s32 index = chess_batch_add(&pb->batch, game);
+        pb->expected[index] = generate_possible_moves(game, &moves);
+        return;
+    }
+
+    Gen_Moves moves;
+    s32 count = generate_possible_moves(game, &moves);
+    for(s32 i = 0; i < count; ++i) {
+        Chess_Undo undo;
+        game_make_move(game, moves.move[i], &undo);
+        perft_batch_walk(pb, game, depth - 1);
+        game_unmake_move(game, moves.move[i], &undo);
+    }
+}
+
+// Single threaded perft that counts the leaves through the batch kernels,
+// mismatches is the number of counts that differ from the generator
+static Perft_Result
+perft_batch_run(Game* root, s32 depth, u64* mismatches)
+{
+    Perft_Result result = {0};
+    r64 start = os_time_us();
+
+    Perft_Batch pb = {0};
+    chess_batch_init(&pb.batch, BATCH_SIZE);
+    pb.counts = calloc(pb.batch.capacity, sizeof(s32));
+    pb.expected = calloc(pb.batch.capacity, sizeof(s32));
+
+    Game game = *root;
+    if(depth == 0)
+        pb.nodes = 1;
+    else
+        perft_batch_walk(&pb, &game, depth);
+    perft_batch_flush(&pb);
+
+    free(pb.counts);
+    free(pb.expected);
+    chess_batch_free(&pb.batch);
+
+    *mismatches = pb.mismatches;
+    result.nodes = pb.nodes;
+    result.elapsed_us = os_time_us() - start;
+    return result;
+}
+
+static void
+print_result(s32 depth, Perft_Result result)
+{
+    r64 seconds = result.elapsed_us / 1000000.0;
+    r64 nps = (seconds > 0) ? result.nodes / seconds : 0;
+    if(depth > 0)
+        printf("Depth %d: ", depth);
+    else
+        printf("Total: ");
+    printf("%llu nodes in %.3fs (%.2f Mnps)", result.nodes, seconds, nps / 1000000.0);
+    if(result.probes > 0)
+        printf(", hash hits %.1f%%", 100.0 * (r64)result.hits / (r64)result.probes);
+    printf("\n");
+}
+
+static void
+print_divide(Game* game, u64* root_nodes)
+{
+    Gen_Moves moves;
+    s32 count = generate_possible_moves(game, &moves);
+    for(s32 i = 0; i < count; ++i) {
+        char name[8];
+        move_to_string(moves.move[i], name);
+        printf("%s: %llu\n", name, root_nodes[i]);
+    }
+    printf("\nMoves: %d\n", count);
+}
+
+static s32
+run_suite(const char* filename, s32 thread_count, Perft_Hash* hash, bool batch)
+{
+    s32 length = 0;
+    char* data = os_file_read(filename, &length, malloc);
+    if(!data)
+        return -1;
+
+    s32 failed = 0, total = 0;
+    Perft_Result sum = {0};
+
+    char* line = data;
+    while(*line) {
+        char* end = line;
+        while(*end && *end != '\n') end++;
+        char next = *end;
+        *end = 0;
+
+        char* depth_text = strchr(line, ';');
+        char* expected_text = (depth_text) ? strchr(depth_text + 1, ';') : 0;
+        if(expected_text) {
+            *depth_text = 0;
+            *expected_text = 0;
+            s32 depth = atoi(depth_text + 1);
+            u64 expected = strtoull(expected_text + 1, 0, 10);
+
+            Game game = {0};
+            game_new(&game);
+            parse_fen(line, &game);
+
+            u64 mismatches = 0;
+            Perft_Result result = (batch) ? perft_batch_run(&game, depth, &mismatches) :
+                perft_run(&game, depth, thread_count, hash, 0);
+            bool passed = (result.nodes == expected && mismatches == 0);
+
+            total++;
+            sum.nodes += result.nodes;
+            sum.hits += result.hits;
+            sum.probes += result.probes;
+            sum.elapsed_us += result.elapsed_us;
+            if(!passed)
+                failed++;
+            printf("%s %s\n  ", (passed) ? "OK  " : "FAIL", line);
+            result.probes = 0;
+            print_result(depth, result);
+            if(result.nodes != expected)
+                printf("  expected %llu\n", expected);
+            if(mismatches > 0)
+                printf("  %llu batch counts differ from the generator\n", mismatches);
+        }
+
+        if(!next) break;
+        line = end + 1;
+    }
+    free(data);
+
+    printf("\n%d/%d positions passed\n", total - failed, total);
+    print_result(0, sum);
+    return failed;
+}
+
+static void
+print_usage()
+{
+    printf("usage: perft [-divide] [-nobulk] [-hash <mb>] [-threads <n>] [-speedup] <depth> [\"fen\"]\n");
+    printf("       perft [-nobulk] [-hash <mb>] [-threads <n>] -suite <file>\n");
+    printf("       perft -batch <depth> [\"fen\"] | -suite <file>\n");
+}
+
+int
+main(int argc, char** argv)
+{
+    bool divide = false;
+    bool speedup = false;
+    bool batch = false;
+    s32 hash_mb = 0;
+    s32 thread_count = 1;
+    const char* suite = 0;
+    s32 depth = 0;
+    char* fen = STARTPOS;
+
+    for(s32 i = 1; i < argc; ++i) {
+        if(strcmp(argv[i], "-divide") == 0) {
+            divide = true;
+        } else if(strcmp(argv[i], "-nobulk") == 0) {
+            bulk_counting = false;
+        } else if(strcmp(argv[i], "-speedup") == 0) {
+            speedup = true;
+        } else if(strcmp(argv[i], "-batch") == 0) {
+            batch = true;
+        } else if(strcmp(argv[i], "-hash") == 0 && i + 1 < argc) {
+            hash_mb = atoi(argv[++i]);
+        } else if(strcmp(argv[i], "-threads") == 0 && i + 1 < argc) {
+            thread_count = atoi(argv[++i]);
+        } else if(strcmp(argv[i], "-suite") == 0 && i + 1 < argc) {
+            suite = argv[++i];
+        } else if(argv[i][0] == '-') {
+            printf("unknown option: %s\n", argv[i]);
+            print_usage();
+            return 1;
+        } else if(depth == 0) {
+            depth = atoi(argv[i]);
+        } else {
+            fen = argv[i];
+        }
+    }
+
+    if(!suite && depth <= 0) {
+        print_usage();
+        return 1;
+    }
+    if(hash_mb > 0 && depth >= MAX_HASH_DEPTH) {
+        printf("depth %d is too deep for -hash, at most %d\n", depth, MAX_HASH_DEPTH - 1);
+        return 1;
+    }
+    if(thread_count <= 0)
+        thread_count = cpu_count();
+
+    Perft_Hash hash = {0};
+    if(hash_mb > 0) {
+        zobrist_init();
+        perft_hash_new(&hash, hash_mb);
+    }
+    Perft_Hash* hash_ptr = (hash_mb > 0) ? &hash : 0;
+
+    if(batch)
+        printf("Batch kernels up to %s\n", batch_kernel_name(batch_kernel_detect()));
+    if(suite)
+        return run_suite(suite, thread_count, hash_ptr, batch) == 0 ? 0 : 1;
+
+    Game game = {0};
+    game_new(&game);
+    if(parse_fen(fen, &game) != 0) {
+        printf("invalid fen: %s\n", fen);
+        return 1;
+    }
+
+    if(batch) {
+        u64 mismatches = 0;
+        Perft_Result result = perft_batch_run(&game, depth, &mismatches);
+        print_result(depth, result);
+        if(mismatches > 0)
+            printf("%llu batch counts differ from the generator\n", mismatches);
+        return (mismatches == 0) ? 0 : 1;
+    }
+
+    u64 root_nodes[256] = {0};
+    Perft_Result result = perft_run(&game, depth, thread_count, hash_ptr, root_nodes);
+    if(divide)
+        print_divide(&game, root_nodes);
+    printf("Threads %d, ", thread_count);
+    print_result(depth, result);
+
+    if(speedup && thread_count > 1) {
+        // Same work from an empty hash so both runs start equal
+        perft_hash_clear(&hash);
+        Perft_Result baseline = perft_run(&game, depth, 1, hash_ptr, 0);
+        printf("Threads 1, ");
+        print_result(depth, baseline);
+        if(baseline.nodes != result.nodes)
+            printf("Node counts differ between runs\n");
+        printf("Speedup %.2fx\n", baseline.elapsed_us / result.elapsed_us);
+    }
+    return 0;
+}
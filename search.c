@@ -0,0 +1,513 @@
+#include <string.h>
+#include "types.h"
+#include "os.h"
+#include "game.h"
+#include "movepick.h"
+#include "tt.h"
+#include "eval.h"
+#include "search.h"
+#include <light_array.h>
+
+#if !defined(_WIN32)
+#include <pthread.h>
+#endif
+
+#define MAX(A, B) (((A) > (B)) ? (A) : (B))
+#define MIN(A, B) (((A) < (B)) ? (A) : (B))
+
+#define ASPIRATION_WINDOW 25    // half width of the first window around the last score
+#define ASPIRATION_DEPTH  4     // shallower iterations are cheap enough to search with a full window
+#define CHECK_INTERVAL    1024  // nodes between checks of the limits, must be a power of two
+
+#define MAX_THREADS       256
+
+// State every thread of one search_run shares. The threads only meet in the
+// transposition table, in the node count and in the stop flag.
+typedef struct {
+    Game* game;
+    TT_Table* tt;               // can be null
+    Search_Limits limits;
+    s32 max_depth;
+    r64 start_us;
+    volatile bool stop;         // set by the main thread once it is done
+    volatile u64 nodes;         // every thread adds its count every CHECK_INTERVAL nodes
+    Search_Report report;
+    void* user;
+    Search_Result* results;     // last completed iteration of every thread
+} Search_Pool;
+
+// One searching thread, index 0 is the main thread that enforces the limits and
+// reports, the others are helpers
+typedef struct {
+    Game game;                  // private copy, moves are made and unmade on it
+    Search_Pool* pool;
+    s32 index;
+    TT_Table* tt;
+    TT_Stats tt_stats;
+    u64 nodes;
+    s32 depth;                  // iteration in progress
+    bool aborted;
+
+    // Hashes of the positions before the current one, back to the last capture
+    // or pawn move, for repetitions
+    s32 key_count;
+    u64 keys[128 + SEARCH_MAX_PLY];
+
+    // Triangular principal variation table, pv[ply] is the line found from ply
+    s32 pv_length[SEARCH_MAX_PLY];
+    Chess_Packed_Move pv[SEARCH_MAX_PLY][SEARCH_MAX_PLY];
+
+    // Line of the last iteration, tried first while the search stays on it
+    bool follow_pv;
+    s32 last_pv_length;
+    Chess_Packed_Move last_pv[SEARCH_MAX_PLY];
+} Search;
+
+// Tapered piece-square evaluation for the side to move, kept up to date by
+// make and unmake so a leaf costs a few multiplies
+s32
+search_evaluate(Game* game)
+{
+    return eval_position(&game->pos);
+}
+
+// Mate scores are stored relative to the node rather than the root, so they
+// stay right when the position is reached again at another ply
+static s32
+score_to_tt(s32 score, s32 ply)
+{
+    if (score > SEARCH_MATE - SEARCH_MAX_PLY)
+        return score + ply;
+    if (score < -SEARCH_MATE + SEARCH_MAX_PLY)
+        return score - ply;
+    return score;
+}
+
+static s32
+score_from_tt(s32 score, s32 ply)
+{
+    if (score > SEARCH_MATE - SEARCH_MAX_PLY)
+        return score - ply;
+    if (score < -SEARCH_MATE + SEARCH_MAX_PLY)
+        return score + ply;
+    return score;
+}
+
+static u64
+atomic_add(volatile u64* value, u64 add)
+{
+#if defined(_WIN32)
+    return (u64)InterlockedExchangeAdd64((volatile LONG64*)value, (LONG64)add);
+#else
+    return __sync_fetch_and_add(value, add);
+#endif
+}
+
+static r64
+elapsed_ms(Search_Pool* pool)
+{
+    return (os_time_us() - pool->start_us) / 1000.0;
+}
+
+static void
+check_limits(Search* search)
+{
+    Search_Pool* pool = search->pool;
+    atomic_add(&pool->nodes, CHECK_INTERVAL);
+    if (pool->stop) {
+        search->aborted = true;
+        return;
+    }
+
+    // Only the main thread looks at the limits, and its first iteration always completes
+    if (search->index != 0 || search->depth <= 1)
+        return;
+    if (pool->limits.stop && *pool->limits.stop)
+        search->aborted = true;
+    if (pool->limits.max_nodes && pool->nodes >= pool->limits.max_nodes)
+        search->aborted = true;
+    if (pool->limits.max_time_ms > 0 && elapsed_ms(pool) >= pool->limits.max_time_ms)
+        search->aborted = true;
+}
+
+// Draw by the fifty move rule, insufficient material or a repetition. Inside the
+// search a single repetition is enough, the side that can avoid it would have.
+static bool
+is_draw(Search* search)
+{
+    Position* pos = &search->game.pos;
+    if (pos->move_draw_count >= 100)
+        return true;
+    if (game_material_class(&search->game) == MATERIAL_INSUFFICIENT)
+        return true;
+
+    s32 first = MAX(0, search->key_count - pos->move_draw_count);
+    for (s32 i = search->key_count - 2; i >= first; i -= 2) {
+        if (search->keys[i] == pos->hash)
+            return true;
+    }
+    return false;
+}
+
+// Resolves the captures left at the horizon so leaves aren't scored in the
+// middle of an exchange. The side to move can stand pat on the evaluation or
+// try captures and promotions, stopping where the picker reaches the ones that
+// lose material by static exchange. In check there is no standing pat and every
+// evasion is searched.
+static s32
+search_quiescence(Search* search, s32 ply, s32 alpha, s32 beta)
+{
+    Game* game = &search->game;
+    search->pv_length[ply] = ply;
+
+    if ((++search->nodes & (CHECK_INTERVAL - 1)) == 0)
+        check_limits(search);
+    if (search->aborted)
+        return 0;
+    if (ply >= SEARCH_MAX_PLY - 1)
+        return search_evaluate(game);
+
+    bool in_check = position_in_check(&game->pos);
+    s32 best = -SEARCH_INFINITE;
+    if (!in_check) {
+        best = search_evaluate(game);
+        if (best >= beta)
+            return best;
+        if (best > alpha)
+            alpha = best;
+    }
+
+    // The legal generator only produces evasions in check
+    Move_Picker picker;
+    move_picker_init(&picker, game, CHESS_MOVE_NONE, !in_check);
+
+    s32 move_count = 0;
+    Chess_Packed_Move move;
+    while ((move = move_picker_next(&picker, game)) != CHESS_MOVE_NONE) {
+        // The picker already sorted the losing captures out, they come last
+        if (!in_check && picker.stage == PICK_BAD_CAPTURES)
+            break;
+        move_count++;
+
+        Chess_Undo undo;
+        game_make_move(game, move, &undo);
+        s32 score = -search_quiescence(search, ply + 1, -beta, -alpha);
+        game_unmake_move(game, move, &undo);
+
+        if (search->aborted)
+            return 0;
+
+        if (score > best) {
+            best = score;
+            if (score > alpha) {
+                alpha = score;
+                search->pv[ply][ply] = move;
+                for (s32 i = ply + 1; i < search->pv_length[ply + 1]; ++i)
+                    search->pv[ply][i] = search->pv[ply + 1][i];
+                search->pv_length[ply] = search->pv_length[ply + 1];
+                if (alpha >= beta)
+                    break;
+            }
+        }
+    }
+
+    if (in_check && move_count == 0)
+        return -SEARCH_MATE + ply;
+    return best;
+}
+
+// Fail soft negamax alpha-beta with principal variation search: the first move
+// gets the full window, the rest a null window that is only widened when a move
+// turns out better than alpha
+static s32
+search_node(Search* search, s32 depth, s32 ply, s32 alpha, s32 beta)
+{
+    Game* game = &search->game;
+    search->pv_length[ply] = ply;
+
+    if ((++search->nodes & (CHECK_INTERVAL - 1)) == 0)
+        check_limits(search);
+    if (search->aborted)
+        return 0;
+
+    if (ply > 0 && is_draw(search))
+        return 0;
+    if (depth <= 0)
+        return search_quiescence(search, ply, alpha, beta);
+    if (ply >= SEARCH_MAX_PLY - 1)
+        return search_evaluate(game);
+
+    // A stored result deep enough ends the node, except on the principal
+    // variation where the line itself is wanted
+    bool pv_node = (beta - alpha > 1);
+    TT_Probe entry = {0};
+    if (search->tt && tt_probe(search->tt, game->pos.hash, &entry, &search->tt_stats)) {
+        s32 score = score_from_tt(entry.score, ply);
+        if (!pv_node && entry.depth >= depth &&
+            (entry.bound == TT_BOUND_EXACT ||
+             (entry.bound == TT_BOUND_LOWER && score >= beta) ||
+             (entry.bound == TT_BOUND_UPPER && score <= alpha)))
+            return score;
+    }
+
+    Chess_Packed_Move hint = entry.move;
+    if (search->follow_pv) {
+        if (ply < search->last_pv_length)
+            hint = search->last_pv[ply];
+        else
+            search->follow_pv = false;
+    }
+
+    Move_Picker picker;
+    move_picker_init(&picker, game, hint, false);
+
+    s32 original_alpha = alpha;
+    s32 best = -SEARCH_INFINITE;
+    Chess_Packed_Move best_move = CHESS_MOVE_NONE;
+    s32 move_count = 0;
+    Chess_Packed_Move move;
+    while ((move = move_picker_next(&picker, game)) != CHESS_MOVE_NONE) {
+        Chess_Undo undo;
+        search->keys[search->key_count++] = game->pos.hash;
+        game_make_move(game, move, &undo);
+        // The child probes its bucket first thing, the load overlaps the draw checks
+        if (search->tt)
+            tt_prefetch(search->tt, game->pos.hash);
+
+        s32 score;
+        if (move_count == 0) {
+            score = -search_node(search, depth - 1, ply + 1, -beta, -alpha);
+        } else {
+            score = -search_node(search, depth - 1, ply + 1, -alpha - 1, -alpha);
+            if (score > alpha && score < beta)
+                score = -search_node(search, depth - 1, ply + 1, -beta, -alpha);
+        }
+
+        game_unmake_move(game, move, &undo);
+        search->key_count--;
+        search->follow_pv = false;
+        move_count++;
+
+        if (search->aborted)
+            return 0;
+
+        if (score > best) {
+            best = score;
+            if (score > alpha) {
+                alpha = score;
+                best_move = move;
+                search->pv[ply][ply] = move;
+                for (s32 i = ply + 1; i < search->pv_length[ply + 1]; ++i)
+                    search->pv[ply][i] = search->pv[ply + 1][i];
+                search->pv_length[ply] = search->pv_length[ply + 1];
+                if (alpha >= beta)
+                    break;
+            }
+        }
+    }
+
+    if (move_count == 0)
+        return (position_in_check(&game->pos)) ? -SEARCH_MATE + ply : 0;
+
+    if (search->tt) {
+        // When every move failed low none of them is known to be best
+        TT_Bound bound = (best >= beta) ? TT_BOUND_LOWER : (best > original_alpha) ? TT_BOUND_EXACT : TT_BOUND_UPPER;
+        tt_store(search->tt, game->pos.hash, best_move, score_to_tt(best, ply), depth, bound, &search->tt_stats);
+    }
+    return best;
+}
+
+// Searches with a narrow window around the score of the last iteration and
+// widens the side that fails until the score falls inside
+static s32
+search_aspiration(Search* search, s32 depth, s32 last_score)
+{
+    s32 delta = ASPIRATION_WINDOW;
+    s32 alpha = -SEARCH_INFINITE, beta = SEARCH_INFINITE;
+    if (depth >= ASPIRATION_DEPTH && !SEARCH_IS_MATE(last_score)) {
+        alpha = last_score - delta;
+        beta = last_score + delta;
+    }
+
+    for (;;) {
+        search->follow_pv = true;
+        s32 score = search_node(search, depth, 0, alpha, beta);
+        if (search->aborted)
+            return 0;
+
+        if (score <= alpha && alpha > -SEARCH_INFINITE) {
+            alpha = MAX(score - delta, -SEARCH_INFINITE);
+        } else if (score >= beta && beta < SEARCH_INFINITE) {
+            beta = MIN(score + delta, SEARCH_INFINITE);
+        } else {
+            return score;
+        }
+        delta *= 2;
+    }
+}
+
+// Iterative deepening of one thread until a limit is reached or the main thread
+// stops it. Every iteration starts with the line of the one before and, with a
+// table, the move orderings of every thread, which makes the deeper ones cheap.
+// Helpers start one ply deeper every other thread, so the threads spread over
+// two depths at a time instead of all searching the same tree in lockstep.
+static void
+search_iterate(Search_Pool* pool, s32 index)
+{
+    Search search;
+    memset(&search, 0, sizeof(search));
+    search.game = *pool->game;
+    search.game.history = 0;
+    search.pool = pool;
+    search.index = index;
+    search.tt = pool->tt;
+
+    // Only keys back to the last capture or pawn move can repeat, and only when
+    // the history actually ends in this position
+    Game_History* history = (Game_History*)pool->game->history;
+    s32 history_count = (history) ? array_length(history->keys) : 0;
+    if (history_count > 0 && history->keys[history_count - 1] == pool->game->pos.hash) {
+        s32 count = MIN(history_count - 1, MIN(pool->game->pos.move_draw_count, 128));
+        for (s32 i = 0; i < count; ++i)
+            search.keys[i] = history->keys[history_count - 1 - count + i];
+        search.key_count = count;
+    }
+
+    Search_Result* result = &pool->results[index];
+    for (s32 depth = 1 + index % 2; depth <= pool->max_depth; ++depth) {
+        search.depth = depth;
+        s32 score = search_aspiration(&search, depth, result->score);
+        if (search.aborted)
+            break;
+
+        result->depth = depth;
+        result->score = score;
+        result->best_move = search.pv[0][0];
+        result->pv_length = search.pv_length[0];
+        memcpy(result->pv, search.pv[0], result->pv_length * sizeof(Chess_Packed_Move));
+        search.last_pv_length = result->pv_length;
+        memcpy(search.last_pv, result->pv, result->pv_length * sizeof(Chess_Packed_Move));
+
+        if (index == 0) {
+            result->nodes = pool->nodes + (search.nodes & (CHECK_INTERVAL - 1));
+            result->elapsed_ms = elapsed_ms(pool);
+            if (pool->report)
+                pool->report(result, pool->user);
+
+            // The next iteration would take several times longer than all of this one
+            if (pool->limits.max_time_ms > 0 && result->elapsed_ms * 2 >= pool->limits.max_time_ms)
+                break;
+        }
+
+        // A forced mate can't get any shorter
+        if (SEARCH_IS_MATE(score) && SEARCH_MATE - abs(score) <= depth)
+            break;
+    }
+
+    atomic_add(&pool->nodes, search.nodes & (CHECK_INTERVAL - 1));
+    result->tt_stats = search.tt_stats;
+}
+
+#if defined(_WIN32)
+typedef HANDLE Search_Thread;
+#else
+typedef pthread_t Search_Thread;
+#endif
+
+typedef struct {
+    Search_Pool* pool;
+    s32 index;
+} Search_Thread_Param;
+
+#if defined(_WIN32)
+static DWORD WINAPI
+search_thread(void* param)
+{
+    Search_Thread_Param* p = (Search_Thread_Param*)param;
+    search_iterate(p->pool, p->index);
+    return 0;
+}
+#else
+static void*
+search_thread(void* param)
+{
+    Search_Thread_Param* p = (Search_Thread_Param*)param;
+    search_iterate(p->pool, p->index);
+    return 0;
+}
+#endif
+
+// Lazy SMP: every thread searches the same root on its own and they share
+// what they find through the table. The main thread decides when to stop, and
+// the result is the deepest iteration completed by any thread, the main thread
+// winning ties. The table can be null, though helpers are useless without it.
+void
+search_run(Game* game, TT_Table* tt, const Search_Limits* limits, Search_Report report, void* user, Search_Result* result)
+{
+    memset(result, 0, sizeof(*result));
+    Gen_Moves moves;
+    if (generate_possible_moves(game, &moves) == 0) {
+        result->score = (position_in_check(&game->pos)) ? -SEARCH_MATE : 0;
+        return;
+    }
+
+    Search_Pool pool = {0};
+    pool.game = game;
+    pool.tt = tt;
+    pool.limits = *limits;
+    pool.report = report;
+    pool.user = user;
+    pool.start_us = os_time_us();
+    pool.max_depth = limits->max_depth;
+    if (pool.max_depth <= 0 || pool.max_depth > SEARCH_MAX_PLY - 1)
+        pool.max_depth = SEARCH_MAX_PLY - 1;
+    if (tt)
+        tt_new_search(tt);
+
+    s32 thread_count = MIN(MAX(limits->threads, 1), MAX_THREADS);
+    pool.results = calloc(thread_count, sizeof(Search_Result));
+    Search_Thread* threads = calloc(thread_count, sizeof(Search_Thread));
+    Search_Thread_Param* params = calloc(thread_count, sizeof(Search_Thread_Param));
+    for (s32 i = 1; i < thread_count; ++i) {
+        params[i].pool = &pool;
+        params[i].index = i;
+#if defined(_WIN32)
+        threads[i] = CreateThread(0, 0, search_thread, &params[i], 0, 0);
+#else
+        pthread_create(&threads[i], 0, search_thread, &params[i]);
+#endif
+    }
+
+    search_iterate(&pool, 0);
+    pool.stop = true;
+
+    for (s32 i = 1; i < thread_count; ++i) {
+#if defined(_WIN32)
+        WaitForSingleObject(threads[i], INFINITE);
+        CloseHandle(threads[i]);
+#else
+        pthread_join(threads[i], 0);
+#endif
+    }
+
+    s32 best = 0;
+    for (s32 i = 1; i < thread_count; ++i) {
+        if (pool.results[i].depth > pool.results[best].depth)
+            best = i;
+    }
+    *result = pool.results[best];
+    if (result->best_move == CHESS_MOVE_NONE)
+        result->best_move = moves.move[0];
+    result->nodes = pool.nodes;
+    result->elapsed_ms = elapsed_ms(&pool);
+    memset(&result->tt_stats, 0, sizeof(result->tt_stats));
+    for (s32 i = 0; i < thread_count; ++i) {
+        result->tt_stats.probes += pool.results[i].tt_stats.probes;
+        result->tt_stats.hits += pool.results[i].tt_stats.hits;
+        result->tt_stats.stores += pool.results[i].tt_stats.stores;
+    }
+
+    free(params);
+    free(threads);
+    free(pool.results);
+}
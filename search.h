@@ -0,0 +1,40 @@
+#pragma once
+#include "types.h"
+#include "game.h"
+#include "tt.h"
+
+#define SEARCH_MAX_PLY  64
+#define SEARCH_INFINITE 32000
+#define SEARCH_MATE     31000   // mate on the board, a mate in n plies scores SEARCH_MATE - n
+
+// Whether a score is a forced mate for one side rather than an evaluation
+#define SEARCH_IS_MATE(SCORE) ((SCORE) > SEARCH_MATE - SEARCH_MAX_PLY || (SCORE) < -SEARCH_MATE + SEARCH_MAX_PLY)
+
+// Budget of a search, zero means no limit. The first iteration always
+// completes so there is a move to play however small the budget is.
+// Node counts are of all the threads together.
+typedef struct {
+    s32 max_depth;          // capped to SEARCH_MAX_PLY
+    u64 max_nodes;
+    r64 max_time_ms;
+    volatile bool* stop;    // optional, set from another thread to end the search
+    s32 threads;            // searching threads sharing the table, 0 or 1 for the caller's alone
+} Search_Limits;
+
+// Outcome of the last completed iteration
+typedef struct {
+    Chess_Packed_Move best_move;    // CHESS_MOVE_NONE when the side to move has no legal move
+    s32 score;                      // centipawns for the side to move, see SEARCH_IS_MATE
+    s32 depth;
+    u64 nodes;                      // every node searched so far, aborted iterations included
+    TT_Stats tt_stats;              // probes, hits and stores of the same nodes
+    r64 elapsed_ms;
+    s32 pv_length;
+    Chess_Packed_Move pv[SEARCH_MAX_PLY];
+} Search_Result;
+
+// Called after every completed iteration
+typedef void (*Search_Report)(const Search_Result* result, void* user);
+
+void search_run(Game* game, TT_Table* tt, const Search_Limits* limits, Search_Report report, void* user, Search_Result* result);
+s32  search_evaluate(Game* game);
@@ -0,0 +1,119 @@
+#include "types.h"
+#include "game.h"
+#include "bitboard.h"
+#include "see.h"
+
+// Exchange values by piece kind, king, queen, rook, knight, bishop, pawn. The
+// king only ever captures last, its value just has to outweigh everything.
+static const s32 see_value[6] = { 20000, 900, 500, 320, 330, 100 };
+
+// Least valuable first
+static const s32 attacker_order[6] = {
+    CHESS_WHITE_PAWN - CHESS_WHITE_KING, CHESS_WHITE_KNIGHT - CHESS_WHITE_KING, CHESS_WHITE_BISHOP - CHESS_WHITE_KING,
+    CHESS_WHITE_ROOK - CHESS_WHITE_KING, CHESS_WHITE_QUEEN - CHESS_WHITE_KING, 0,
+};
+
+static s32
+piece_kind(Chess_Piece piece)
+{
+    return (piece - CHESS_WHITE_KING) % (CHESS_BLACK_KING - CHESS_WHITE_KING);
+}
+
+// Static exchange evaluation: material won or lost by the side making move when
+// every piece that attacks the target square recaptures on it, least valuable
+// first, and either side may stop once going on would lose. Pins are ignored.
+// Positive for a winning capture, 0 for even trades and for quiet moves to safe
+// squares, negative when the piece moved is lost, quiet moves onto an attacked
+// square included.
+s32
+see_move(Position* pos, Chess_Packed_Move move)
+{
+    s32 from = CHESS_MOVE_FROM(move), to = CHESS_MOVE_TO(move);
+    s32 flag = CHESS_MOVE_FLAG(move);
+    if (flag == CHESS_MOVE_CASTLE)
+        return 0;
+
+    Chess_Bitboards* bb = &pos->bb;
+    Chess_Piece piece = pos->board[from / 8][from % 8];
+    Chess_Piece victim = pos->board[to / 8][to % 8];
+    u64 occupancy = (bb->color[CHESS_COLOR_WHITE] | bb->color[CHESS_COLOR_BLACK]) ^ (1ULL << from);
+
+    s32 gain[32];
+    gain[0] = (victim != CHESS_NONE) ? see_value[piece_kind(victim)] : 0;
+    s32 on_square = see_value[piece_kind(piece)];
+    if (flag == CHESS_MOVE_EN_PASSANT) {
+        gain[0] = see_value[piece_kind(CHESS_WHITE_PAWN)];
+        occupancy ^= 1ULL << ((from / 8) * 8 + to % 8);
+    } else if (flag == CHESS_MOVE_PROMOTION) {
+        static const s32 promotion_kind[4] = { 3, 4, 2, 1 }; // indexed by Chess_Promotion
+        on_square = see_value[promotion_kind[CHESS_MOVE_PROMOTION(move)]];
+        gain[0] += on_square - see_value[piece_kind(CHESS_WHITE_PAWN)];
+    }
+
+    Chess_Color side = (piece >= CHESS_BLACK_KING) ? CHESS_COLOR_WHITE : CHESS_COLOR_BLACK;
+    u64 attackers = position_attackers_to(pos, to, occupancy);
+    u64 diagonal = bb->piece[CHESS_WHITE_BISHOP] | bb->piece[CHESS_BLACK_BISHOP] | bb->piece[CHESS_WHITE_QUEEN] | bb->piece[CHESS_BLACK_QUEEN];
+    u64 straight = bb->piece[CHESS_WHITE_ROOK] | bb->piece[CHESS_BLACK_ROOK] | bb->piece[CHESS_WHITE_QUEEN] | bb->piece[CHESS_BLACK_QUEEN];
+
+    s32 depth = 0;
+    for (;;) {
+        u64 ours = attackers & bb->color[side];
+        if (!ours)
+            break;
+
+        Chess_Piece base = (side == CHESS_COLOR_WHITE) ? CHESS_WHITE_KING : CHESS_BLACK_KING;
+        s32 kind = 0;
+        u64 attacker = 0;
+        for (s32 i = 0; i < 6 && !attacker; ++i) {
+            kind = attacker_order[i];
+            attacker = ours & bb->piece[base + kind];
+        }
+        // The king can't take when the other side still defends the square
+        if (kind == 0 && (attackers & bb->color[!side]))
+            break;
+
+        depth++;
+        gain[depth] = on_square - gain[depth - 1];
+        on_square = see_value[kind];
+
+        occupancy ^= 1ULL << bb_lsb(attacker);
+        attackers |= (bb_bishop_attacks(to, occupancy) & diagonal) | (bb_rook_attacks(to, occupancy) & straight);
+        attackers &= occupancy;
+        side = !side;
+        if (depth == 31)
+            break;
+    }
+
+    // Each side takes the better of stopping and recapturing, from the last capture back
+    while (depth > 0) {
+        gain[depth - 1] = -((-gain[depth - 1] > gain[depth]) ? -gain[depth - 1] : gain[depth]);
+        depth--;
+    }
+    return gain[0];
+}
+
+// Pieces of color, the king aside, the other side can win material by
+// capturing, i.e. with a capture of positive static exchange value
+u64
+see_hanging(Position* pos, Chess_Color color)
+{
+    u64 occupancy = pos->bb.color[CHESS_COLOR_WHITE] | pos->bb.color[CHESS_COLOR_BLACK];
+    u64 pieces = pos->bb.color[color] & ~(pos->bb.piece[CHESS_WHITE_KING] | pos->bb.piece[CHESS_BLACK_KING]);
+    u64 hanging = 0;
+
+    while (pieces) {
+        s32 square = bb_lsb(pieces);
+        pieces &= pieces - 1;
+
+        u64 attackers = position_attackers_to(pos, square, occupancy) & pos->bb.color[!color];
+        while (attackers) {
+            s32 from = bb_lsb(attackers);
+            attackers &= attackers - 1;
+            if (see_move(pos, CHESS_PACK_MOVE(from, square, 0, CHESS_MOVE_NORMAL)) > 0) {
+                hanging |= 1ULL << square;
+                break;
+            }
+        }
+    }
+    return hanging;
+}
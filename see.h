@@ -0,0 +1,6 @@
+#pragma once
+#include "types.h"
+#include "game.h"
+
+s32 see_move(Position* pos, Chess_Packed_Move move);
+u64 see_hanging(Position* pos, Chess_Color color);
@@ -0,0 +1,195 @@
+#include <stdlib.h>
+#include <string.h>
+#include "types.h"
+#include "tt.h"
+
+#if defined(_WIN32)
+#include <windows.h>
+#include <xmmintrin.h>
+#elif defined(__linux__)
+#include <sys/mman.h>
+#endif
+
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+#define TT_MOVE(DATA)       ((Chess_Packed_Move)((DATA) & 0xffff))
+#define TT_SCORE(DATA)      ((s16)(((DATA) >> 16) & 0xffff))
+#define TT_DEPTH(DATA)      ((s8)(((DATA) >> 32) & 0xff))
+#define TT_BOUND(DATA)      ((u8)(((DATA) >> 40) & 0x3))
+#define TT_GENERATION(DATA) ((u8)(((DATA) >> 42) & 0x3f))
+
+static u64
+tt_pack(Chess_Packed_Move move, s32 score, s32 depth, TT_Bound bound, u8 generation)
+{
+    return (u64)move | ((u64)(u16)(s16)score << 16) | ((u64)(u8)(s8)depth << 32) |
+        ((u64)bound << 40) | ((u64)(generation & 0x3f) << 42);
+}
+
+static void*
+tt_alloc(u64 size, bool* huge_pages)
+{
+    void* memory = 0;
+#if defined(_WIN32)
+    // Large pages need the lock pages privilege, without it the normal allocation is used
+    SIZE_T large_page = GetLargePageMinimum();
+    if (*huge_pages && large_page > 0 && size % large_page == 0)
+        memory = VirtualAlloc(0, size, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+    *huge_pages = (memory != 0);
+    if (!memory)
+        memory = _aligned_malloc(size, 64);
+#else
+    if (*huge_pages && size % HUGE_PAGE_SIZE == 0) {
+        memory = aligned_alloc(HUGE_PAGE_SIZE, size);
+#if defined(__linux__)
+        // Only a hint, the kernel backs what it can with transparent huge pages
+        if (memory)
+            madvise(memory, size, MADV_HUGEPAGE);
+#endif
+    }
+    *huge_pages = (memory != 0);
+    if (!memory)
+        memory = aligned_alloc(64, size);
+#endif
+    return memory;
+}
+
+// Sizes the table to the largest power of two of buckets that fits in megabytes.
+// Huge pages are only a request, huge_pages in the table says if they were used.
+bool
+tt_new(TT_Table* tt, s32 megabytes, bool huge_pages)
+{
+    memset(tt, 0, sizeof(*tt));
+    u64 count = 1;
+    while (count * 2 * sizeof(TT_Bucket) <= (u64)megabytes * 1024 * 1024)
+        count *= 2;
+
+    tt->huge_pages = huge_pages;
+    tt->buckets = tt_alloc(count * sizeof(TT_Bucket), &tt->huge_pages);
+    if (!tt->buckets)
+        return false;
+    tt->mask = count - 1;
+    tt->size = count * sizeof(TT_Bucket);
+    tt_clear(tt);
+    return true;
+}
+
+void
+tt_free(TT_Table* tt)
+{
+#if defined(_WIN32)
+    if (tt->huge_pages)
+        VirtualFree(tt->buckets, 0, MEM_RELEASE);
+    else
+        _aligned_free(tt->buckets);
+#else
+    free(tt->buckets);
+#endif
+    memset(tt, 0, sizeof(*tt));
+}
+
+void
+tt_clear(TT_Table* tt)
+{
+    if (tt->buckets)
+        memset((void*)tt->buckets, 0, tt->size);
+    tt->generation = 0;
+}
+
+// Called before every search, entries of older searches are replaced first
+void
+tt_new_search(TT_Table* tt)
+{
+    tt->generation = (tt->generation + 1) % TT_GENERATIONS;
+}
+
+static TT_Bucket*
+tt_bucket(TT_Table* tt, u64 key)
+{
+    return &tt->buckets[key & tt->mask];
+}
+
+void
+tt_prefetch(TT_Table* tt, u64 key)
+{
+#if defined(_WIN32)
+    _mm_prefetch((const char*)tt_bucket(tt, key), _MM_HINT_T0);
+#else
+    __builtin_prefetch(tt_bucket(tt, key));
+#endif
+}
+
+bool
+tt_probe(TT_Table* tt, u64 key, TT_Probe* probe, TT_Stats* stats)
+{
+    TT_Bucket* bucket = tt_bucket(tt, key);
+    stats->probes++;
+    for (s32 i = 0; i < TT_BUCKET_ENTRIES; ++i) {
+        u64 data = bucket->entry[i].data;
+        u64 check = bucket->entry[i].check;
+        if ((check ^ data) != key || data == 0)
+            continue;
+
+        probe->move = TT_MOVE(data);
+        probe->score = TT_SCORE(data);
+        probe->depth = TT_DEPTH(data);
+        probe->bound = TT_BOUND(data);
+        stats->hits++;
+        return true;
+    }
+    return false;
+}
+
+// Stores over the entry of the same position if there is one, else over the
+// entry worth the least: empty first, then the shallowest, where every
+// generation of age costs as much as 8 plies of depth
+void
+tt_store(TT_Table* tt, u64 key, Chess_Packed_Move move, s32 score, s32 depth, TT_Bound bound, TT_Stats* stats)
+{
+    TT_Bucket* bucket = tt_bucket(tt, key);
+    TT_Entry* replace = 0;
+    s32 replace_value = 0;
+
+    for (s32 i = 0; i < TT_BUCKET_ENTRIES; ++i) {
+        TT_Entry* entry = &bucket->entry[i];
+        u64 data = entry->data;
+        u64 check = entry->check;
+
+        if ((check ^ data) == key && data != 0) {
+            // A shallower bound of this search doesn't replace a deeper result
+            if (bound != TT_BOUND_EXACT && depth + 4 < TT_DEPTH(data) && TT_GENERATION(data) == tt->generation)
+                return;
+            if (move == CHESS_MOVE_NONE)
+                move = TT_MOVE(data);
+            replace = entry;
+            break;
+        }
+
+        s32 age = (tt->generation - TT_GENERATION(data)) & (TT_GENERATIONS - 1);
+        s32 value = (data == 0) ? -1024 : TT_DEPTH(data) - 8 * age;
+        if (!replace || value < replace_value) {
+            replace = entry;
+            replace_value = value;
+        }
+    }
+
+    u64 data = tt_pack(move, score, depth, bound, tt->generation);
+    replace->check = key ^ data;
+    replace->data = data;
+    stats->stores++;
+}
+
+// Permille of a sample of entries written by the current search
+s32
+tt_hashfull(TT_Table* tt)
+{
+    u64 sample = (tt->mask + 1 < 250) ? tt->mask + 1 : 250;
+    s32 used = 0;
+    for (u64 i = 0; i < sample; ++i) {
+        for (s32 j = 0; j < TT_BUCKET_ENTRIES; ++j) {
+            u64 data = tt->buckets[i].entry[j].data;
+            if (data != 0 && TT_GENERATION(data) == tt->generation)
+                used++;
+        }
+    }
+    return (s32)(used * 1000 / (sample * TT_BUCKET_ENTRIES));
+}
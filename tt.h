@@ -0,0 +1,61 @@
+#pragma once
+#include "types.h"
+#include "game.h"
+
+// Bound of a stored score relative to the real one
+typedef enum {
+    TT_BOUND_NONE  = 0,
+    TT_BOUND_UPPER = 1,     // every move failed low, the score is at most this
+    TT_BOUND_LOWER = 2,     // a move failed high, the score is at least this
+    TT_BOUND_EXACT = 3,
+} TT_Bound;
+
+#define TT_BUCKET_ENTRIES 4
+#define TT_GENERATIONS    64    // generation is 6 bits, it wraps around
+
+// Data is packed in one word: move in bits 0-15, score in bits 16-31, depth in
+// bits 32-39, bound in bits 40-41 and generation in bits 42-47. check holds the
+// key xored with data, so an entry torn by two threads writing at once fails
+// verification instead of handing out data of another position. No locks.
+typedef struct {
+    volatile u64 check;
+    volatile u64 data;
+} TT_Entry;
+
+// One cache line, a probe touches a single line
+typedef struct CHESS_ALIGN(64) {
+    TT_Entry entry[TT_BUCKET_ENTRIES];
+} TT_Bucket;
+
+typedef struct {
+    TT_Bucket* buckets;
+    u64 mask;               // bucket count minus one, the count is a power of two
+    u64 size;               // bytes allocated
+    u8  generation;         // of the current search, stamped on every store
+    bool huge_pages;        // memory was requested in huge pages
+} TT_Table;
+
+// Unpacked entry, what a probe returns
+typedef struct {
+    Chess_Packed_Move move; // CHESS_MOVE_NONE when only a score is known
+    s16 score;
+    s8  depth;
+    u8  bound;              // TT_Bound
+} TT_Probe;
+
+// Counters of one searching thread, the table itself has none so threads don't
+// fight over the cache line of a shared counter. Add them up for the hit rate.
+typedef struct {
+    u64 probes;
+    u64 hits;
+    u64 stores;
+} TT_Stats;
+
+bool tt_new(TT_Table* tt, s32 megabytes, bool huge_pages);
+void tt_free(TT_Table* tt);
+void tt_clear(TT_Table* tt);
+void tt_new_search(TT_Table* tt);
+bool tt_probe(TT_Table* tt, u64 key, TT_Probe* probe, TT_Stats* stats);
+void tt_store(TT_Table* tt, u64 key, Chess_Packed_Move move, s32 score, s32 depth, TT_Bound bound, TT_Stats* stats);
+void tt_prefetch(TT_Table* tt, u64 key);
+s32  tt_hashfull(TT_Table* tt);
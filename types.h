@@ -0,0 +1,20 @@
+#pragma once
+
+// Basic types shared by every module. The rules code (game, fen, bitboard and
+// the move generators) only depends on this header, so it builds on any platform
+// without os.h and its windows.h.
+
+typedef long long s64;
+typedef int s32;
+typedef short s16;
+typedef char s8;
+typedef unsigned long long u64;
+typedef unsigned int u32;
+typedef unsigned short u16;
+typedef unsigned char u8;
+typedef double r64;
+typedef float r32;
+
+typedef int bool;
+#define true 1
+#define false 0